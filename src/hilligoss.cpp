@@ -9,98 +9,677 @@ THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR I
 */
 #include "hilligoss.h"
 
-// Quickly delete an item from a vector by swapping the target and the last element,
-// then popping the last element. This does not preserve the order of the vector, but
-// we're already working in a random order so it's fine
-template <class T>
-void quickDelete(std::vector<T>& vec, int idx) {
-    vec[idx] = vec.back();
-    vec.pop_back();
-}
+// On x86-64 with GCC or Clang the vectorized kernels are built for SSE4.2, AVX2 and AVX-512 as well as
+// for whatever the compiler is targeting, and the best set the CPU has is picked when it's first needed
+// (see simdKernels()). Anywhere else they're only built for what the compiler is targeting.
+#if defined(__GNUC__) && defined(__x86_64__)
+#define SIMD_DISPATCH 1
+#define TARGET_SSE42 __attribute__((target("sse4.2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#else
+#define SIMD_DISPATCH 0
+#define TARGET_SSE42
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 inline double lerp(double a, double b, double t) {
 	return a + ((b - a) * t);
 }
 
-void hilligoss(const std::vector<unsigned char> image, std::vector<int16_t>& destination, int targetCount, unsigned char blackThreshold, unsigned char whiteThreshold, int jumpPeriod, int searchDistance, double boost, double curve, int mode, int frameNumber, int borderSamples, bool invert, std::mt19937 rng) {
+// The stages of a frame that use random numbers
+#define STAGE_CHOOSE 0
+#define STAGE_ROUTE 1
+
+// The generator to use for <stage> of a frame. Philox4x32 jumps to a stream of the stage's own; other
+// engines just carry on from where the last stage left off.
+template <class Rng>
+static Rng& forStage(Rng& rng, int) {
+    return rng;
+}
+
+static Philox4x32& forStage(Philox4x32& rng, int stage) {
+    rng.setStage(stage);
+    return rng;
+}
+
+// The size of the image being converted, and how its pixels line up with the sample values. The longer
+// side spans the whole output range and the shorter one is centred, so the picture keeps its shape.
+struct Raster {
+    int width;
+    int height;
+    // The longer of the two sides
+    int side;
+    // The smallest power of 2 that covers both sides, which is what the Hilbert curve is built on
+    int curveSide;
+
+    Raster(int width, int height)
+        : width(width), height(height), side(std::max(width, height)), curveSide((int)std::bit_ceil((unsigned)std::max(width, height))) {}
+
+    // Convert a pixel coordinate into the sample value it's drawn at
+    int16_t sampleX(int x) const {
+        return (int16_t)(((x - width / 2) * SHRT_MAX / side) * 2);
+    }
+    int16_t sampleY(int y) const {
+        return (int16_t)((-((y - height / 2) * SHRT_MAX / side) - 1) * 2);
+    }
+
+    // Convert a sample value back into the pixel coordinate it was drawn from
+    int pixelX(int16_t x) const {
+        return std::clamp((int)std::lround(x * (side / (2.0 * SHRT_MAX))) + width / 2, 0, width - 1);
+    }
+    int pixelY(int16_t y) const {
+        return std::clamp(height / 2 - (int)std::lround(y * (side / (2.0 * SHRT_MAX))), 0, height - 1);
+    }
+};
+
+// The samples for the border around the edge of the screen
+static std::vector<int16_t> makeBorder(int borderSamples) {
+	std::vector<int16_t> border;
+	border.reserve(borderSamples * 2);
+	int sideSamples = borderSamples / 4;
+	int extraSideSamples = borderSamples % 4;
+	
+	// top
+	for (int i = 0; i < sideSamples; i++) {
+		border.push_back((int16_t)(lerp(-1.0, 1.0, i / (double)sideSamples) * 32767));
+		border.push_back(32767);
+	}
+	
+	// right
+	for (int i = 0; i < sideSamples; i++) {
+		border.push_back(32767);
+		border.push_back((int16_t)(lerp(1.0, -1.0, i / (double)sideSamples) * 32767));
+	}
+	
+	// bottom
+	for (int i = 0; i < sideSamples; i++) {
+		border.push_back((int16_t)(lerp(1.0, -1.0, i / (double)sideSamples) * 32767));
+		border.push_back(-32767);
+	}
+	
+	// left
+	for (int i = 0; i < sideSamples + extraSideSamples; i++) {
+		border.push_back(-32767);
+		border.push_back((int16_t)(lerp(-1.0, 1.0, i / (double)(extraSideSamples + sideSamples)) * 32767));
+	}
+
+	return border;
+}
+
+// Side length of the blue noise threshold map, which gets tiled over the image
+#define BLUE_NOISE_SIZE 64
+
+// Build a tileable blue noise threshold map using the void-and-cluster method: every cell gets a rank
+// such that the cells below any rank are spread out as evenly as possible. Takes a few tens of
+// milliseconds, so it's only done once (see blueNoise()).
+static std::vector<float> makeBlueNoise() {
+    const int n = BLUE_NOISE_SIZE;
+    const int count = n * n;
+    const double sigma = 1.5;
+
+    // How much a point adds to the energy of the cells around it, wrapping around the edges
+    std::vector<float> kernel(count);
+    for (int dy = 0; dy < n; dy++) {
+        for (int dx = 0; dx < n; dx++) {
+            int wx = std::min(dx, n - dx);
+            int wy = std::min(dy, n - dy);
+            kernel[dy * n + dx] = (float)std::exp(-(wx * wx + wy * wy) / (2 * sigma * sigma));
+        }
+    }
+
+    std::vector<float> energy(count, 0);
+    std::vector<char> on(count, 0);
+    auto toggle = [&](int p, bool set) {
+        on[p] = set;
+        float sign = set ? 1.0f : -1.0f;
+        int px = p % n;
+        int py = p / n;
+        for (int y = 0; y < n; y++) {
+            const float* row = &kernel[((y - py + n) % n) * n];
+            for (int x = 0; x < n; x++) {
+                energy[y * n + x] += sign * row[(x - px + n) % n];
+            }
+        }
+    };
+    auto tightestCluster = [&]() {
+        int best = -1;
+        for (int p = 0; p < count; p++) {
+            if (on[p] && (best < 0 || energy[p] > energy[best])) best = p;
+        }
+        return best;
+    };
+    auto largestVoid = [&]() {
+        int best = -1;
+        for (int p = 0; p < count; p++) {
+            if (!on[p] && (best < 0 || energy[p] < energy[best])) best = p;
+        }
+        return best;
+    };
+
+    // Start with some random points, then move the most crowded one to the emptiest spot until it settles
+    std::mt19937 g(1);
+    int ones = count / 10;
+    for (int placed = 0; placed < ones;) {
+        int p = std::uniform_int_distribution<int>(0, count - 1)(g);
+        if (on[p]) continue;
+        toggle(p, true);
+        placed++;
+    }
+    while (true) {
+        int cluster = tightestCluster();
+        toggle(cluster, false);
+        int gap = largestVoid();
+        toggle(gap, true);
+        if (gap == cluster) break;
+    }
+    std::vector<char> prototypeOn = on;
+    std::vector<float> prototypeEnergy = energy;
+
+    // Rank the starting points by taking them away most crowded first, then rank the rest by filling in the emptiest spots
+    std::vector<int> rank(count);
+    for (int r = ones - 1; r >= 0; r--) {
+        int cluster = tightestCluster();
+        toggle(cluster, false);
+        rank[cluster] = r;
+    }
+    on = prototypeOn;
+    energy = prototypeEnergy;
+    for (int r = ones; r < count; r++) {
+        int gap = largestVoid();
+        toggle(gap, true);
+        rank[gap] = r;
+    }
+
+    std::vector<float> thresholds(count);
+    for (int p = 0; p < count; p++) thresholds[p] = (rank[p] + 0.5f) / count;
+    return thresholds;
+}
+
+// The blue noise threshold map, built the first time it's needed
+static const std::vector<float>& blueNoise() {
+    static const std::vector<float> thresholds = makeBlueNoise();
+    return thresholds;
+}
+
+// The value of a pixel, turned negative (wrapping around) if the image is being inverted
+template <bool Invert>
+static inline unsigned char pixelValueOf(uint8_t pixel) {
+    return Invert ? (unsigned char)-pixel : pixel;
+}
+
+// Pixels checked by each call to liveMask
+#define LIVE_BLOCK 64
 
-#ifdef TIMEIT
-    auto now1 = std::chrono::steady_clock::now();
+// Bit i of the result is set if <pixels>[i] is brighter than <black> once it's been inverted (if it's
+// being inverted), for LIVE_BLOCK pixels. There's one of these for each instruction set, see liveMask.
+// The SSE2 and AVX2 byte comparisons are signed, so both sides are flipped by 0x80 to compare them
+// unsigned.
+#if SIMD_DISPATCH || defined(__AVX512BW__)
+template <bool Invert>
+TARGET_AVX512 static inline uint64_t liveMaskAvx512(const uint8_t* pixels, unsigned char black) {
+    __m512i v = _mm512_loadu_si512(pixels);
+    if (Invert) v = _mm512_sub_epi8(_mm512_setzero_si512(), v);
+    return _mm512_cmpgt_epu8_mask(v, _mm512_set1_epi8((char)black));
+}
 #endif
 
-    // Select a subset of pixels from the image
-    std::vector<int> pixels = choosePixels(image, targetCount, blackThreshold, whiteThreshold, boost, curve, mode, rng, frameNumber, invert);
+#if SIMD_DISPATCH || defined(__AVX2__)
+template <bool Invert>
+TARGET_AVX2 static inline uint64_t liveMaskAvx2(const uint8_t* pixels, unsigned char black) {
+    const __m256i flip = _mm256_set1_epi8((char)0x80);
+    const __m256i threshold = _mm256_set1_epi8((char)(black ^ 0x80));
+    uint64_t mask = 0;
+    for (int i = 0; i < LIVE_BLOCK / 32; i++) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(pixels + i * 32));
+        if (Invert) v = _mm256_sub_epi8(_mm256_setzero_si256(), v);
+        __m256i live = _mm256_cmpgt_epi8(_mm256_xor_si256(v, flip), threshold);
+        mask |= (uint64_t)(uint32_t)_mm256_movemask_epi8(live) << (i * 32);
+    }
+    return mask;
+}
+#endif
 
-#ifdef TIMEIT
+#if defined(__SSE2__)
+template <bool Invert>
+static inline uint64_t liveMaskSse2(const uint8_t* pixels, unsigned char black) {
+    const __m128i flip = _mm_set1_epi8((char)0x80);
+    const __m128i threshold = _mm_set1_epi8((char)(black ^ 0x80));
+    uint64_t mask = 0;
+    for (int i = 0; i < LIVE_BLOCK / 16; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(pixels + i * 16));
+        if (Invert) v = _mm_sub_epi8(_mm_setzero_si128(), v);
+        __m128i live = _mm_cmpgt_epi8(_mm_xor_si128(v, flip), threshold);
+        mask |= (uint64_t)(uint32_t)_mm_movemask_epi8(live) << (i * 16);
+    }
+    return mask;
+}
+#endif
 
-    auto duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - now1).count() * 0.001;
-    std::cout << " choosePixels - " << duration << " milliseconds" << std::endl;
-    auto now2 = std::chrono::steady_clock::now();
+// The live pixel mask with whatever the compiler is targeting, for the places that check a block or two
+// at a time and can't make up for calling through simdKernels()
+template <bool Invert>
+static inline uint64_t liveMask(const uint8_t* pixels, unsigned char black) {
+#if defined(__AVX512BW__)
+    return liveMaskAvx512<Invert>(pixels, black);
+#elif defined(__AVX2__)
+    return liveMaskAvx2<Invert>(pixels, black);
+#elif defined(__SSE2__)
+    return liveMaskSse2<Invert>(pixels, black);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    // NEON has no movemask, so each lane keeps its own bit and the halves are added up
+    static const uint8_t laneBits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    const uint8x16_t bits = vld1q_u8(laneBits);
+    const uint8x16_t threshold = vdupq_n_u8(black);
+    uint64_t mask = 0;
+    for (int i = 0; i < LIVE_BLOCK / 16; i++) {
+        uint8x16_t v = vld1q_u8(pixels + i * 16);
+        if (Invert) v = vsubq_u8(vdupq_n_u8(0), v);
+        uint8x16_t live = vandq_u8(vcgtq_u8(v, threshold), bits);
+        uint64_t laneMask = (uint64_t)vaddv_u8(vget_low_u8(live)) | ((uint64_t)vaddv_u8(vget_high_u8(live)) << 8);
+        mask |= laneMask << (i * 16);
+    }
+    return mask;
+#else
+    uint64_t mask = 0;
+    for (int i = 0; i < LIVE_BLOCK; i++) mask |= (uint64_t)(pixelValueOf<Invert>(pixels[i]) > black) << i;
+    return mask;
 #endif
+}
 
-    // Order the pixels and convert them into samples
-    std::vector<int16_t> samples = determinePath(pixels, targetCount, jumpPeriod, searchDistance, rng);
+// Fill <masks> with the live pixel masks of <blocks> blocks of LIVE_BLOCK pixels in a row, one function
+// for each instruction set
+template <bool Invert>
+static void liveMasksGeneric(const uint8_t* pixels, int blocks, unsigned char black, uint64_t* masks) {
+    for (int b = 0; b < blocks; b++) masks[b] = liveMask<Invert>(pixels + b * LIVE_BLOCK, black);
+}
+
+#if SIMD_DISPATCH
+template <bool Invert>
+TARGET_SSE42 static void liveMasksSse42(const uint8_t* pixels, int blocks, unsigned char black, uint64_t* masks) {
+    for (int b = 0; b < blocks; b++) masks[b] = liveMaskSse2<Invert>(pixels + b * LIVE_BLOCK, black);
+}
+
+template <bool Invert>
+TARGET_AVX2 static void liveMasksAvx2(const uint8_t* pixels, int blocks, unsigned char black, uint64_t* masks) {
+    for (int b = 0; b < blocks; b++) masks[b] = liveMaskAvx2<Invert>(pixels + b * LIVE_BLOCK, black);
+}
 
-#ifdef TIMEIT
-    duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - now2).count() * 0.001;
-    std::cout << "determinePath - " << duration << " milliseconds" << std::endl;
-    duration = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - now1).count() * 0.001;
-    std::cout << "        total - " << duration << " milliseconds" << std::endl << std::endl;
+template <bool Invert>
+TARGET_AVX512 static void liveMasksAvx512(const uint8_t* pixels, int blocks, unsigned char black, uint64_t* masks) {
+    for (int b = 0; b < blocks; b++) masks[b] = liveMaskAvx512<Invert>(pixels + b * LIVE_BLOCK, black);
+}
 #endif
 
-	if (borderSamples > 0) {
-		std::vector<double> border;
-		border.reserve(borderSamples * 2);
-		int sideSamples = borderSamples / 4;
-		int extraSideSamples = borderSamples % 4;
-		
-		// top
-		for (int i = 0; i < sideSamples; i++) {
-			border.push_back(lerp(-1.0, 1.0, i / (double)sideSamples));
-			border.push_back(1.0);
-		}
-		
-		// right
-		for (int i = 0; i < sideSamples; i++) {
-			border.push_back(1.0);
-			border.push_back(lerp(1.0, -1.0, i / (double)sideSamples));
-		}
-		
-		// bottom
-		for (int i = 0; i < sideSamples; i++) {
-			border.push_back(lerp(1.0, -1.0, i / (double)sideSamples));
-			border.push_back(-1.0);
-		}
-		
-		// left
-		for (int i = 0; i < sideSamples + extraSideSamples; i++) {
-			border.push_back(-1.0);
-			border.push_back(lerp(-1.0, 1.0, i / (double)(extraSideSamples + sideSamples)));
-		}
-		
-		samples.reserve(samples.size() + borderSamples * 2);
-		
-		for (int i = 0; i < borderSamples * 2; i++) {
-			samples.push_back((int16_t)(border[i] * 32767));
-		}
-	}
+// The hot vectorized kernels built for one instruction set, see simdKernels()
+struct SimdKernels {
+    // What setSimdVariant() calls it
+    const char* name;
+    // Whether the CPU this is running on can use them
+    bool (*supported)();
+    // liveMasks, not inverted and inverted
+    void (*liveMasks[2])(const uint8_t* pixels, int blocks, unsigned char black, uint64_t* masks);
+    // closestPointBlocks
+    int (*closestPointBlocks)(const int16_t* xs, const int16_t* ys, int n, int px, int py, int32_t sD, int32_t* laneDist, int32_t* laneIndex);
+};
+
+static const SimdKernels& simdKernels();
 
-    // Add the samples onto the end of the destination vector
-    destination.insert(destination.end(), samples.begin(), samples.end());
+// Blocks that forEachLivePixel gets the masks of in one go
+#define LIVE_CHUNK 16
+
+// Run <f> on the position and value of every pixel in <row> that's brighter than <black>, in order.
+// Dark pixels are skipped LIVE_BLOCK at a time, so black areas and letterboxing cost next to nothing.
+template <bool Invert, class F>
+static inline void forEachLivePixel(const uint8_t* row, int width, unsigned char black, F f) {
+    auto liveMasks = simdKernels().liveMasks[Invert];
+    uint64_t masks[LIVE_CHUNK];
+    int x = 0;
+    while (x + LIVE_BLOCK <= width) {
+        int blocks = std::min(LIVE_CHUNK, (width - x) / LIVE_BLOCK);
+        liveMasks(row + x, blocks, black, masks);
+        for (int b = 0; b < blocks; b++, x += LIVE_BLOCK) {
+            uint64_t mask = masks[b];
+            if (mask == ~0ULL) {
+                // A straight run is quicker than going bit by bit when the whole block is lit
+                for (int i = x; i < x + LIVE_BLOCK; i++) f(i, pixelValueOf<Invert>(row[i]));
+                continue;
+            }
+            for (; mask != 0; mask &= mask - 1) {
+                int i = x + std::countr_zero(mask);
+                f(i, pixelValueOf<Invert>(row[i]));
+            }
+        }
+    }
+    for (; x < width; x++) {
+        unsigned char pixelValue = pixelValueOf<Invert>(row[x]);
+        if (pixelValue > black) f(x, pixelValue);
+    }
 }
 
-// Choose <targetCount> pixels from <image> that are greater than <black>, skewing towards <white> with a curve factor of <curve> then boosting everything by <boost>.
-std::vector<int> choosePixels(const std::vector<unsigned char>& image, int targetCount, unsigned char black, unsigned char white, double boost, double curve, int mode, std::mt19937& g, int frameNumber, bool invert) {
-    int pixelCount = 0;
-    int x, y, x_temp, y_temp, s;
-    double z, v;
+// Rows of pixels in each tile of a TileMap
+#define TILE_ROWS 16
 
-    // This will be the list of chosen pixels
-    std::vector<int> pixels;
-    pixels.reserve(targetCount);
+// Which tiles of the image have anything above the black level in them, so the samplers only have to
+// look at the lit parts of a mostly black frame. Tiles are LIVE_BLOCK pixels wide (the last one in a
+// row can be narrower) and TILE_ROWS tall, with one bit each.
+struct TileMap {
+    int width = 0;
+    int across = 0;
+    int words = 0;
+    std::vector<uint64_t> lit;
 
-    // Create a lookup table of all the possible pixel values and their curved counterparts
-    double lookup[256];
+    template <bool Invert>
+    void build(const uint8_t* image, int stride, const Raster& raster, unsigned char black) {
+        width = raster.width;
+        across = (raster.width + LIVE_BLOCK - 1) / LIVE_BLOCK;
+        words = (across + 63) / 64;
+        int down = (raster.height + TILE_ROWS - 1) / TILE_ROWS;
+        lit.assign(down * words, 0);
+        for (int ty = 0; ty < down; ty++) {
+            int yEnd = std::min(raster.height, (ty + 1) * TILE_ROWS);
+            for (int tx = 0; tx < across; tx++) {
+                int x = tx * LIVE_BLOCK;
+                bool any = false;
+                for (int y = ty * TILE_ROWS; y < yEnd && !any; y++) {
+                    const uint8_t* row = image + y * stride + x;
+                    if (x + LIVE_BLOCK <= raster.width) {
+                        any = liveMask<Invert>(row, black) != 0;
+                    }
+                    else {
+                        for (int i = 0; i < raster.width - x && !any; i++) any = pixelValueOf<Invert>(row[i]) > black;
+                    }
+                }
+                if (any) lit[ty * words + (tx >> 6)] |= 1ULL << (tx & 63);
+            }
+        }
+    }
+
+    // Run <f> on the start and end of each run of lit tiles that row <y> goes through, left to right
+    template <class F>
+    void forEachLitSpan(int y, F f) const {
+        const uint64_t* row = &lit[(y / TILE_ROWS) * words];
+        int tx = 0;
+        while (tx < across) {
+            // Find the next lit tile and the end of the run it starts
+            uint64_t word = row[tx >> 6] >> (tx & 63);
+            if (word == 0) {
+                tx = (tx | 63) + 1;
+                continue;
+            }
+            tx += std::countr_zero(word);
+            int end = tx;
+            while (end < across && (row[end >> 6] >> (end & 63) & 1)) end++;
+            f(tx * LIVE_BLOCK, std::min(width, end * LIVE_BLOCK));
+            tx = end;
+        }
+    }
+};
+
+// Run <f> on the position and value of every pixel in row <y> that's brighter than <black>, in order,
+// only looking at the lit tiles in <tiles>
+template <bool Invert, class F>
+static inline void forEachLitPixel(const TileMap& tiles, const uint8_t* row, int y, unsigned char black, F f) {
+    tiles.forEachLitSpan(y, [&](int start, int end) {
+        forEachLivePixel<Invert>(row + start, end - start, black, [&](int x, unsigned char pixelValue) {
+            f(start + x, pixelValue);
+        });
+    });
+}
+
+// Fill <weight> with the weight of each pixel value relative to the brightest possible, and 0 for the
+// ones that can't be picked
+static void makeWeights(const double* lookup, unsigned char black, float* weight) {
+    double maxLookup = 0.00001;
+    for (int v = black + 1; v < 256; v++) maxLookup = std::max(maxLookup, lookup[v]);
+    for (int v = 0; v < 256; v++) weight[v] = v > black ? (float)(lookup[v] / maxLookup) : 0.0f;
+}
+
+// Fill <scaled> with the blue noise threshold each pixel value has to beat in sampleByStipple, scaled so
+// that about <wanted> of the image's pixels beat theirs. Returns how many pixels are above the black level.
+template <bool Invert>
+static long stippleScale(const uint8_t* image, int stride, const Raster& raster, const TileMap& tiles, const double* lookup, unsigned char black, int wanted, float* scaled) {
+    float weight[256];
+    makeWeights(lookup, black, weight);
+
+    // Only the pixels above the black level can be picked, so only they need counting
+    int histogram[256] = { 0 };
+    for (int y = 0; y < raster.height; y++) {
+        forEachLitPixel<Invert>(tiles, image + y * stride, y, black, [&](int, unsigned char pixelValue) {
+            histogram[pixelValue]++;
+        });
+    }
+
+    // Find the scale where the expected number of pixels under the threshold matches
+    auto expected = [&](double scale) {
+        double total = 0;
+        for (int v = black + 1; v < 256; v++) total += histogram[v] * std::min(1.0, scale * weight[v]);
+        return total;
+    };
+    double low = 0;
+    double high = 1;
+    while (expected(high) < wanted && high < 1e9) high *= 2;
+    for (int i = 0; i < 50; i++) {
+        double mid = (low + high) * 0.5;
+        if (expected(mid) < wanted) low = mid;
+        else high = mid;
+    }
+    for (int v = 0; v < 256; v++) scaled[v] = (float)(high * weight[v]);
+
+    long lit = 0;
+    for (int v = black + 1; v < 256; v++) lit += histogram[v];
+    return lit;
+}
+
+// Pick about <wanted> pixels by comparing each one's curved value with a tiled blue noise threshold
+// from <scaled> (see stippleScale). The scaling makes the expected number that pass the number wanted,
+// so the selection itself is one branch-free pass over the lit pixels. The threshold map shifts every
+// frame so the dots sparkle. Mode 2 stipples half as many dots and the padding draws each of them
+// twice, making them brighter.
+template <bool Invert, class Rng>
+static void sampleByStipple(const uint8_t* image, int stride, const Raster& raster, const TileMap& tiles, const float* scaled, unsigned char black, int wanted, int frameNumber, Rng& g, std::vector<int>& pixels, std::vector<int>& selected) {
+    const std::vector<float>& thresholds = blueNoise();
+
+    // Select every pixel that's over its threshold
+    int offsetX = (frameNumber * 37) % BLUE_NOISE_SIZE;
+    int offsetY = (frameNumber * 23) % BLUE_NOISE_SIZE;
+    selected.resize(raster.width * raster.height);
+    int n = 0;
+    for (int y = 0; y < raster.height; y++) {
+        const float* row = &thresholds[((y + offsetY) % BLUE_NOISE_SIZE) * BLUE_NOISE_SIZE];
+        forEachLitPixel<Invert>(tiles, image + y * stride, y, black, [&](int x, unsigned char pixelValue) {
+            selected[n] = y * raster.width + x;
+            n += row[(x + offsetX) % BLUE_NOISE_SIZE] < scaled[pixelValue];
+        });
+    }
+
+    // If there's zero valid pixels, add one in the center of the image
+    if (n == 0) {
+        pixels.push_back(raster.width >> 1);
+        pixels.push_back(raster.height >> 1);
+        return;
+    }
+
+    // A few too many can pass by chance, so drop random ones until it's right. Whatever's left gets
+    // shuffled too, since the routing starts its strokes from the front of the list.
+    int keep = std::min(n, wanted);
+    for (int i = 0; i < keep; i++) {
+        int j = std::uniform_int_distribution<int>(i, n - 1)(g);
+        std::swap(selected[i], selected[j]);
+        pixels.push_back(selected[i] % raster.width);
+        pixels.push_back(selected[i] / raster.width);
+    }
+}
+
+// Candidates bucketed by pixel value. Bucket b starts at candidates[start[b]] and has remaining[b]
+// candidates left in it that haven't been picked.
+struct Buckets {
+    int start[257];
+    int remaining[256];
+    int available;
+
+    // Total curved value of the candidates left
+    double weight(const double* lookup) const {
+        double total = 0;
+        for (int b = 0; b < 256; b++) total += remaining[b] * lookup[b];
+        return total;
+    }
+};
+
+// Bucket the candidates above the black level into <buckets> and <candidates>. The candidates are every
+// pixel, or if <Grid> is set, the pixels on a grid of lines <gridPeriod> pixels apart (a power of 2)
+// offset by <gridPhase>. Each candidate is y * width + x.
+template <bool Invert, bool Grid>
+static void bucketCandidates(const uint8_t* image, int stride, const Raster& raster, const TileMap& tiles, int gridPeriod, int gridPhase, unsigned char black, Buckets& buckets, std::vector<int>& candidates) {
+    // Run <f> on every candidate along with its value, in order. On the grid that's whole rows where
+    // a horizontal line is, and every <gridPeriod>th pixel everywhere else.
+    auto forEachCandidate = [&](auto f) {
+        for (int y = 0; y < raster.height; y++) {
+            const uint8_t* imageRow = image + y * stride;
+            if (!Grid || (y & (gridPeriod - 1)) == gridPhase) {
+                forEachLitPixel<Invert>(tiles, imageRow, y, black, [&](int x, unsigned char pixelValue) {
+                    f(y * raster.width + x, pixelValue);
+                });
+            }
+            else {
+                // Tiles start on a multiple of the period, so the columns line up with them
+                tiles.forEachLitSpan(y, [&](int start, int end) {
+                    for (int x = start + gridPhase; x < end; x += gridPeriod) {
+                        unsigned char pixelValue = pixelValueOf<Invert>(imageRow[x]);
+                        if (pixelValue > black) f(y * raster.width + x, pixelValue);
+                    }
+                });
+            }
+        }
+    };
+
+    int* start = buckets.start;
+    std::fill(start, start + 257, 0);
+    forEachCandidate([&](int, unsigned char pixelValue) {
+        start[pixelValue + 1]++;
+    });
+    for (int b = 0; b < 256; b++) {
+        buckets.remaining[b] = start[b + 1];
+        start[b + 1] += start[b];
+    }
+    buckets.available = start[256];
+
+    candidates.resize(buckets.available);
+    int fill[256];
+    std::copy(start, start + 256, fill);
+    forEachCandidate([&](int c, unsigned char pixelValue) {
+        candidates[fill[pixelValue]++] = c;
+    });
+}
+
+// Pick <targetCount> of the bucketed candidates without replacement, each with a chance proportional to
+// its curved value, and add them to <pixels> moved down by <top> rows. Each pick chooses a bucket using a
+// Fenwick tree of the buckets' total weights (8 steps for 256 buckets) and takes a random candidate out
+// of it, so it's O(targetCount) no matter how dark the frame is. The picks are swapped to the end of
+// their buckets and swapped back afterwards (<swaps> is room for that), so <buckets> and <candidates>
+// are left as they were and can be drawn from again for another frame of the same image.
+template <class Rng>
+static void drawFromBuckets(const Buckets& buckets, std::vector<int>& candidates, const Raster& raster, int top, const double* lookup, int targetCount, Rng& g, std::vector<int>& pixels, std::vector<int>& swaps) {
+    const int* start = buckets.start;
+
+    // If there's zero valid pixels, add one in the center of the image
+    if (buckets.available == 0) {
+        pixels.push_back(raster.width >> 1);
+        pixels.push_back(top + (raster.height >> 1));
+        return;
+    }
+
+    // If there aren't enough candidates to choose from, take all of them
+    if (buckets.available <= targetCount) {
+        for (int c : candidates) {
+            pixels.push_back(c % raster.width);
+            pixels.push_back(top + c / raster.width);
+        }
+        return;
+    }
+
+    int remaining[256];
+    std::copy(buckets.remaining, buckets.remaining + 256, remaining);
+
+    // Fenwick tree of the total weight left in each bucket
+    double tree[257] = { 0 };
+    auto addWeight = [&tree](int b, double w) {
+        for (int i = b + 1; i <= 256; i += i & -i) tree[i] += w;
+    };
+    double total = 0;
+    for (int b = 0; b < 256; b++) {
+        if (remaining[b] == 0) continue;
+        addWeight(b, remaining[b] * lookup[b]);
+        total += remaining[b] * lookup[b];
+    }
+
+    swaps.resize(targetCount * 2);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    for (int n = 0; n < targetCount; n++) {
+        // Find the bucket that the random point in the total weight lands in
+        double u = uniform(g) * total;
+        int b = 0;
+        for (int step = 256; step > 0; step >>= 1) {
+            if (b + step <= 256 && tree[b + step] <= u) {
+                b += step;
+                u -= tree[b];
+            }
+        }
+
+        // Rounding errors can land it on an empty bucket, use the brightest one left if so
+        if (b > 255 || remaining[b] == 0) {
+            for (b = 255; remaining[b] == 0; b--);
+        }
+
+        // Take a random candidate out of the bucket
+        int j = start[b] + std::uniform_int_distribution<int>(0, remaining[b] - 1)(g);
+        int c = candidates[j];
+        int last = start[b] + --remaining[b];
+        candidates[j] = candidates[last];
+        candidates[last] = c;
+        swaps[n * 2] = j;
+        swaps[n * 2 + 1] = last;
+        addWeight(b, -lookup[b]);
+        total -= lookup[b];
+
+        pixels.push_back(c % raster.width);
+        pixels.push_back(top + c / raster.width);
+    }
+
+    // Put the candidates back in their original order
+    for (int n = targetCount - 1; n >= 0; n--) {
+        std::swap(candidates[swaps[n * 2]], candidates[swaps[n * 2 + 1]]);
+    }
+}
+
+// Pick <targetCount> of the candidates (see bucketCandidates) without replacement, each with a chance
+// proportional to its curved value. Returns how many candidates there were.
+template <bool Invert, bool Grid, class Rng>
+static int sampleByHistogram(const uint8_t* image, int stride, const Raster& raster, const TileMap& tiles, int gridPeriod, int gridPhase, const double* lookup, unsigned char black, int targetCount, Rng& g, std::vector<int>& pixels, std::vector<int>& candidates, std::vector<int>& swaps) {
+    Buckets buckets;
+    bucketCandidates<Invert, Grid>(image, stride, raster, tiles, gridPeriod, gridPhase, black, buckets, candidates);
+    drawFromBuckets(buckets, candidates, raster, 0, lookup, targetCount, g, pixels, swaps);
+    return buckets.available;
+}
+
+// How many pixels of <raster> are on the grid of lines <gridPeriod> pixels apart offset by <gridPhase>
+// (see bucketCandidates)
+static long gridPositions(const Raster& raster, int gridPeriod, int gridPhase) {
+    long rows = raster.height > gridPhase ? (raster.height - 1 - gridPhase) / gridPeriod + 1 : 0;
+    long columns = raster.width > gridPhase ? (raster.width - 1 - gridPhase) / gridPeriod + 1 : 0;
+    return rows * raster.width + (raster.height - rows) * columns;
+}
+
+// Fill <lookup> with the curved counterparts of all the possible pixel values
+static void makeLookup(unsigned char black, unsigned char white, double boost, double curve, double* lookup) {
+    double z;
     for (double i = 0; i < 256; i++) {
         // Set white level using (i - black) / (white - black), clamped to prevent problems
         z = std::max(0.0, i - black) / std::max(0.00001, double(white - black));
@@ -114,133 +693,414 @@ std::vector<int> choosePixels(const std::vector<unsigned char>& image, int targe
         // Ensure values are not unreasonably high (to prevent rounding errors later)
         lookup[int(i)] = std::min(512.0, z);
     }
+}
 
-    // Create a list of candidates to select, then shuffle them up
+// One band of the image in sampleByBands
+struct BandScratch {
+    TileMap tiles;
+    Buckets buckets;
     std::vector<int> candidates;
-    candidates.reserve(PIX_CT * PIX_CT);
-    for (int i = 0; i < PIX_CT * PIX_CT; i++) {
-        if (mode >= 3 && mode <= 6) {
-            x = i % PIX_CT;
-            y = (int)(i / PIX_CT) % PIX_CT;
+    std::vector<int> swaps;
+    std::vector<int> pixels;
+};
 
-            x_temp = ((x >> (mode - 2)) << (mode - 2)) + ((frameNumber) % (int)std::pow(2, mode - 2));
-            y_temp = ((y >> (mode - 2)) << (mode - 2)) + ((frameNumber) % (int)std::pow(2, mode - 2));
+// Working space for the samplers, kept from one frame to the next. prepareSamples leaves what it found
+// out about the image here for drawSamples.
+struct SampleScratch {
+    TileMap tiles;
+    Buckets buckets{};
+    std::vector<int> candidates;
+    std::vector<int> swaps;
+    // Stipple thresholds for each pixel value (see stippleScale)
+    float scaled[256] = { 0 };
+    // Side of the cells to sample from (see sampleByLevel), or 1 for every pixel
+    int scale = 1;
+    // The coarser level of the image and its tiles, and a row of running totals for making it
+    std::vector<uint8_t> level;
+    TileMap levelTiles;
+    std::vector<float> sums;
+    // The bands and how many points each one gets (see sampleByBands)
+    std::vector<BandScratch> bands;
+    std::vector<int> shares;
+    int bandHeight = 0;
+    // How many candidates the last frame's points were picked from, out of how many pixels (or cells of
+    // the coarser level) were looked at, for HilligossStats
+    long candidateCount = 0;
+    long positionCount = 0;
+};
 
-            if (x == x_temp || y == y_temp) {
-                candidates.push_back(i);
-            }
-        }
-        else {
-            candidates.push_back(i);
+// Bands to split the image into for each thread in sampleByBands
+#define SAMPLE_BANDS_PER_THREAD 4
+
+// Run <f> on every band of <scratch>, with each of <threads> threads taking every <threads>th one
+template <class F>
+static void forEachBand(const Raster& raster, int threads, SampleScratch& scratch, F f) {
+    int count = (int)scratch.bands.size();
+    int bandHeight = scratch.bandHeight;
+    auto run = [&](int t) {
+        for (int b = t; b < count; b += threads) {
+            int top = b * bandHeight;
+            f(scratch.bands[b], top, Raster(raster.width, std::min(bandHeight, raster.height - top)), b);
         }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; t++) {
+        workers.push_back(std::thread(run, t));
+    }
+    run(0);
+    for (std::thread& w : workers) {
+        w.join();
     }
-    std::shuffle(candidates.begin(), candidates.end(),g);
+}
+
+// Bucket the candidates in each band of <scratch> and share out <targetCount> points between them in
+// proportion to their weight, with the ones left over from rounding down going to the bands that lost
+// the most to it. No shares at all means there's nothing to pick.
+template <bool Invert, bool Grid>
+static void bucketBands(const uint8_t* image, int stride, const Raster& raster, int gridPeriod, int gridPhase, const double* lookup, unsigned char black, int targetCount, int threads, SampleScratch& scratch) {
+    forEachBand(raster, threads, scratch, [&](BandScratch& band, int top, const Raster& bandRaster, int) {
+        bucketCandidates<Invert, Grid>(image + top * stride, stride, bandRaster, band.tiles, gridPeriod, gridPhase, black, band.buckets, band.candidates);
+    });
 
-    // This controls how likely a pixel is to be rejected when it's just above the threshold
-    double greed = 0.8;
+    int count = (int)scratch.bands.size();
+    std::vector<double> weights(count);
+    double total = 0;
+    scratch.candidateCount = 0;
+    scratch.positionCount = Grid ? gridPositions(raster, gridPeriod, gridPhase) : (long)raster.width * raster.height;
+    for (int b = 0; b < count; b++) {
+        weights[b] = scratch.bands[b].buckets.weight(lookup);
+        total += weights[b];
+        scratch.candidateCount += scratch.bands[b].buckets.available;
+    }
+    std::vector<int>& shares = scratch.shares;
+    shares.clear();
+    if (total <= 0) return;
 
-    // Start on the first pixel in the shuffled list
-    int index = 0;
+    shares.resize(count);
+    std::vector<int> byRemainder(count);
+    int shared = 0;
+    for (int b = 0; b < count; b++) {
+        shares[b] = (int)(targetCount * weights[b] / total);
+        shared += shares[b];
+        byRemainder[b] = b;
+    }
+    std::stable_sort(byRemainder.begin(), byRemainder.end(), [&](int a, int b) {
+        return targetCount * weights[a] / total - shares[a] > targetCount * weights[b] / total - shares[b];
+    });
+    for (int i = 0; shared < targetCount; i = (i + 1) % count, shared++) {
+        shares[byRemainder[i]]++;
+    }
+}
 
-    // Loop until we've picked enough pixels
-    while (pixelCount < targetCount) {
-        // Pick a random number between 0 and <white> with some extra resolution
-        z = rand() % (100 * white) * 0.01;
+// Cut the image into horizontal bands for sampleByBands, enough for <threads> threads, and find each
+// one's lit tiles. Off the grid, the candidates are the same every frame, so they get bucketed too.
+template <bool Invert>
+static void prepareBands(const uint8_t* image, int stride, const Raster& raster, const double* lookup, unsigned char black, int targetCount, int threads, bool grid, SampleScratch& scratch) {
+    // Bands are a whole number of tiles tall, so the grid's lines land the same way in each one
+    int count = threads * SAMPLE_BANDS_PER_THREAD;
+    int bandHeight = std::max(1, (raster.height + count * TILE_ROWS - 1) / (count * TILE_ROWS)) * TILE_ROWS;
+    scratch.bandHeight = bandHeight;
+    scratch.bands.resize((raster.height + bandHeight - 1) / bandHeight);
 
-        // Removed to test different curve system
-        //// If that random number is so low it can't be picked, don't check any further
-		// if (z < lookup[black] * greed) continue;
+    forEachBand(raster, threads, scratch, [&](BandScratch& band, int top, const Raster& bandRaster, int) {
+        band.tiles.build<Invert>(image + top * stride, stride, bandRaster, black);
+    });
+    if (!grid) bucketBands<Invert, false>(image, stride, raster, 1, 0, lookup, black, targetCount, threads, scratch);
+}
 
-        // Get the pixel value at the current index and curve it
-        unsigned char pixelValue = image[candidates[index]] * (1 - (2 * invert));
-        v = lookup[pixelValue] * greed;
+// Pick <targetCount> of the candidates like sampleByHistogram, but split between <threads> threads. The
+// image is cut into horizontal bands (see prepareBands), each band gets a share of the points in
+// proportion to its total curved value, and then they're picked from each band separately with a random
+// number engine of its own. That also spreads the points out more evenly than picking them from the
+// whole image at once.
+template <bool Invert, bool Grid, class Rng>
+static void sampleByBands(const uint8_t* image, int stride, const Raster& raster, int gridPeriod, int gridPhase, const double* lookup, unsigned char black, int targetCount, Rng& g, int threads, std::vector<int>& pixels, SampleScratch& scratch) {
+    int count = (int)scratch.bands.size();
+    std::vector<Rng> bandRngs;
+    for (int b = 0; b < count; b++) {
+        bandRngs.push_back(Rng{ (unsigned)g() });
+    }
 
-        // get X and Y coordinates at the current index
-        x = candidates[index] % PIX_CT;
-        y = (int)(candidates[index] / PIX_CT) % PIX_CT;
+    // The grid moves every frame, so its candidates have to be bucketed for each one
+    if (Grid) bucketBands<Invert, true>(image, stride, raster, gridPeriod, gridPhase, lookup, black, targetCount, threads, scratch);
+    const std::vector<int>& shares = scratch.shares;
+    if (shares.empty()) {
+        pixels.push_back(raster.width >> 1);
+        pixels.push_back(raster.height >> 1);
+        return;
+    }
 
-        // If the candidate is less than the black value...
-        if (pixelValue <= black) {
-            // Remove it from the list, making sure not to skip a candidate
-            quickDelete(candidates, index);
-            index--;
-        }
+    // Pick them
+    forEachBand(raster, threads, scratch, [&](BandScratch& band, int top, const Raster& bandRaster, int b) {
+        band.pixels.clear();
+        if (shares[b] > 0 && band.buckets.available > 0) drawFromBuckets(band.buckets, band.candidates, bandRaster, top, lookup, shares[b], bandRngs[b], band.pixels, band.swaps);
+    });
 
-        // Otherwise, if the candidate's curved pixel value is greater than the random number...
-        else if (v > z) {
-            // Add it to the chosen pixels and increase the tally of chosen pixels
-            pixels.push_back(x);
-            pixels.push_back(y);
-            pixelCount++;
+    // Shuffle them together, since the routing starts its strokes from the front of the list
+    size_t first = pixels.size();
+    for (BandScratch& band : scratch.bands) {
+        pixels.insert(pixels.end(), band.pixels.begin(), band.pixels.end());
+    }
+    int n = (int)(pixels.size() - first) / 2;
+    for (int i = 0; i < n - 1; i++) {
+        int j = std::uniform_int_distribution<int>(i, n - 1)(g);
+        std::swap(pixels[first + i * 2], pixels[first + j * 2]);
+        std::swap(pixels[first + i * 2 + 1], pixels[first + j * 2 + 1]);
+    }
+}
 
-            // Remove it from the list, making sure not to skip a candidate
-            quickDelete(candidates, index);
-            index--;
-        }
+// Fewest cells there can be per point when sampling from a coarser level (see sampleByLevel)
+#define LOD_CELLS_PER_POINT 32
+// Side of the cells in the finest and coarsest levels, in pixels. Finer than 4 is never quicker than
+// sampling every pixel.
+#define LOD_MIN_SCALE 4
+#define LOD_MAX_SCALE 16
+// Fewest lit pixels there can be per point when sampling from a coarser level. With fewer, bucketing
+// the lit pixels directly is quicker than totalling up the cells.
+#define LOD_LIT_PER_POINT 256
 
-        // If there's no candidates in the list now that we've removed some...
-        if (candidates.size() <= 0) {
-            // If there's zero valid pixels, add one in the center of the image
-            while (pixels.size() < 2) pixels.push_back(PIX_CT >> 1);
+// Side of the cells to sample <targetCount> points from, in pixels. That's 1 (every pixel) unless the
+// image has plenty of pixels per point, in which case it's the coarsest power of 2 that still leaves
+// LOD_CELLS_PER_POINT cells per point.
+static int levelScale(const Raster& raster, int targetCount) {
+    int scale = 1;
+    while (scale < LOD_MAX_SCALE) {
+        int next = scale * 2;
+        long cells = (long)((raster.width + next - 1) / next) * ((raster.height + next - 1) / next);
+        if (cells < (long)LOD_CELLS_PER_POINT * targetCount) break;
+        scale = next;
+    }
+    return scale < LOD_MIN_SCALE ? 1 : scale;
+}
+
+// Whether <image> has roughly <wanted> pixels brighter than <black> or more, going by every 4th row of
+// the lit tiles in <tiles>
+template <bool Invert>
+static bool hasLitPixels(const uint8_t* image, int stride, const Raster& raster, const TileMap& tiles, unsigned char black, long wanted) {
+    auto liveMasks = simdKernels().liveMasks[Invert];
+    uint64_t masks[LIVE_CHUNK];
+    long count = 0;
+    wanted = (wanted + 3) / 4;
+    for (int y = 0; y < raster.height && count < wanted; y += 4) {
+        const uint8_t* imageRow = image + y * stride;
+        tiles.forEachLitSpan(y, [&](int start, int end) {
+            int x = start;
+            while (x + LIVE_BLOCK <= end) {
+                int blocks = std::min(LIVE_CHUNK, (end - x) / LIVE_BLOCK);
+                liveMasks(imageRow + x, blocks, black, masks);
+                for (int b = 0; b < blocks; b++) count += std::popcount(masks[b]);
+                x += blocks * LIVE_BLOCK;
+            }
+            for (; x < end; x++) count += pixelValueOf<Invert>(imageRow[x]) > black;
+        });
+    }
+    return count >= wanted;
+}
+
+// Make the coarser level of the image for sampleByLevel, out of <scale> x <scale> cells (a power of 2),
+// and bucket its cells. Each cell's value is the total curved value of its pixels scaled to fit a byte,
+// so a cell is as likely to be picked as all its pixels put together.
+template <bool Invert>
+static void prepareLevel(const uint8_t* image, int stride, const Raster& raster, int scale, const double* lookup, unsigned char black, SampleScratch& scratch) {
+    int shift = std::countr_zero((unsigned)scale);
+    Raster levelRaster((raster.width + scale - 1) >> shift, (raster.height + scale - 1) >> shift);
+    float weight[256];
+    makeWeights(lookup, black, weight);
+
+    // Total up the weights in each cell a row of cells at a time. The lit pixels come in order, so
+    // each run of them in one cell is added up before it's stored. Any cell with a lit pixel stays
+    // at 1 or more so it stays a candidate.
+    float toLevel = 255.0f / (scale * scale);
+    scratch.level.resize(levelRaster.width * levelRaster.height);
+    scratch.sums.assign(levelRaster.width, 0);
+    float* sums = scratch.sums.data();
+    for (int y = 0; y < raster.height; y++) {
+        int cell = 0;
+        float sum = 0;
+        forEachLitPixel<Invert>(scratch.tiles, image + y * stride, y, black, [&](int x, unsigned char pixelValue) {
+            if ((x >> shift) != cell) {
+                sums[cell] += sum;
+                cell = x >> shift;
+                sum = 0;
+            }
+            sum += weight[pixelValue];
+        });
+        sums[cell] += sum;
 
-            // Break out of the loop, as there aren't any candidates to potentially choose
-            break;
+        if (((y + 1) & (scale - 1)) == 0 || y == raster.height - 1) {
+            uint8_t* levelRow = &scratch.level[(y >> shift) * levelRaster.width];
+            for (int cx = 0; cx < levelRaster.width; cx++) {
+                levelRow[cx] = sums[cx] > 0 ? (uint8_t)std::clamp((int)(sums[cx] * toLevel + 0.5f), 1, 255) : 0;
+                sums[cx] = 0;
+            }
         }
+    }
+
+    scratch.levelTiles.build<false>(scratch.level.data(), levelRaster.width, levelRaster, 0);
+    bucketCandidates<false, false>(scratch.level.data(), levelRaster.width, levelRaster, scratch.levelTiles, 1, 0, 0, scratch.buckets, scratch.candidates);
+}
+
+// Pick <targetCount> pixels the same way as sampleByHistogram, but from the coarser level of the image
+// made by prepareLevel. Then one pixel in each picked cell is picked in proportion to its curved value.
+// The lit pixels still get read once to total up the cells, but only 1/scale^2 as many candidates get
+// bucketed.
+template <bool Invert, class Rng>
+static void sampleByLevel(const uint8_t* image, int stride, const Raster& raster, int scale, const double* lookup, unsigned char black, int targetCount, Rng& g, std::vector<int>& pixels, SampleScratch& scratch) {
+    int shift = std::countr_zero((unsigned)scale);
+    Raster levelRaster((raster.width + scale - 1) >> shift, (raster.height + scale - 1) >> shift);
+    float weight[256];
+    makeWeights(lookup, black, weight);
+
+    // The cells' values are already in proportion to their weight
+    double linear[256];
+    for (int v = 0; v < 256; v++) linear[v] = v;
+
+    // Pick the cells
+    size_t first = pixels.size();
+    drawFromBuckets(scratch.buckets, scratch.candidates, levelRaster, 0, linear, targetCount, g, pixels, scratch.swaps);
 
-        // If the number of candidates left in the list is less than the number of candidates needed...
-        if (candidates.size() < targetCount - pixelCount) {
-            // Go through the remaining candidates
-            for (index = 0; index < candidates.size(); index++) {
-                // Get X and Y coordinates
-                x = candidates[index] % PIX_CT;
-                y = (int)(candidates[index] / PIX_CT) % PIX_CT;
+    // Then a pixel in each of them
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    for (size_t i = first; i < pixels.size(); i += 2) {
+        int x0 = pixels[i] << shift;
+        int y0 = pixels[i + 1] << shift;
+        int x1 = std::min(raster.width, x0 + scale);
+        int y1 = std::min(raster.height, y0 + scale);
 
-                // If the candidate's pixel value is above the black threshold...
-                if (image[candidates[index]] > black) {
-                    // Add it to the list
-                    pixels.push_back(x);
-                    pixels.push_back(y);
+        double total = 0;
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) total += weight[pixelValueOf<Invert>(image[y * stride + x])];
+        }
+
+        // The cell's middle if it's empty (which only happens when nothing is lit at all)
+        int px = std::min(raster.width - 1, x0 + scale / 2);
+        int py = std::min(raster.height - 1, y0 + scale / 2);
+        double u = uniform(g) * total;
+        for (int y = y0; y < y1 && total > 0; y++) {
+            for (int x = x0; x < x1; x++) {
+                float w = weight[pixelValueOf<Invert>(image[y * stride + x])];
+                if (w == 0) continue;
+                px = x;
+                py = y;
+                u -= w;
+                if (u < 0) {
+                    total = 0;
+                    break;
                 }
             }
-            // Break out of the loop, as we've picked all the candidates
-            break;
         }
+        pixels[i] = px;
+        pixels[i + 1] = py;
+    }
+}
+
+// Whether <mode> is one of the sparkly modes, which stipple the whole image in one pass instead of
+// picking from a list of candidates
+static bool isStippleMode(int mode) {
+    return mode == 1 || mode == 2;
+}
+
+// Whether <mode> is one of the scrolling grid modes, which use lines 2^(mode - 2) pixels apart that move
+// along one pixel a frame
+static bool isGridMode(int mode) {
+    return mode >= 3 && mode <= 6;
+}
+
+// Do the part of the sampling for <mode> that's the same for every frame of <image>, leaving it in
+// <scratch> for drawSamples. That's finding the lit tiles, and bucketing the candidates or making the
+// coarser level when the candidates don't move from one frame to the next. <Invert> is fixed so the
+// loops over the pixels don't check it.
+template <bool Invert>
+static void prepareSamples(const uint8_t* image, int stride, const Raster& raster, int targetCount, unsigned char black, const double* lookup, int mode, int threads, SampleScratch& scratch) {
+    if (threads > 1 && !isStippleMode(mode)) {
+        // The bands each find their own lit tiles
+        prepareBands<Invert>(image, stride, raster, lookup, black, targetCount, threads, isGridMode(mode), scratch);
+        return;
+    }
+
+    // Find the parts of the image with anything in them first, so the samplers can skip the rest
+    TileMap& tiles = scratch.tiles;
+    tiles.build<Invert>(image, stride, raster, black);
+    scratch.scale = 1;
+    scratch.positionCount = (long)raster.width * raster.height;
+
+    if (isStippleMode(mode)) {
+        scratch.candidateCount = stippleScale<Invert>(image, stride, raster, tiles, lookup, black, mode == 2 ? std::max(1, targetCount / 2) : targetCount, scratch.scaled);
+    }
+    else if (isGridMode(mode)) {
+        // The grid moves every frame, so there's nothing else to do ahead of time
+    }
+    else if (int scale = levelScale(raster, targetCount); scale > 1 && hasLitPixels<Invert>(image, stride, raster, tiles, black, (long)LOD_LIT_PER_POINT * targetCount)) {
+        // Every pixel is a candidate, but there are so few points for so many of them that a coarser
+        // level will do
+        scratch.scale = scale;
+        prepareLevel<Invert>(image, stride, raster, scale, lookup, black, scratch);
+        scratch.candidateCount = scratch.buckets.available;
+        scratch.positionCount = (long)((raster.width + scale - 1) / scale) * ((raster.height + scale - 1) / scale);
+    }
+    else {
+        // Every pixel is a candidate
+        bucketCandidates<Invert, false>(image, stride, raster, tiles, 1, 0, black, scratch.buckets, scratch.candidates);
+        scratch.candidateCount = scratch.buckets.available;
+    }
+}
 
-        if (mode == 1 || mode == 2) {
-            // Advance by a randomized amount of pixels to make reshuffling unnecessary
-            index += rand() % PIX_CT;
+// Run the sampler for <mode> on the image last given to prepareSamples, with the mode and <Invert> fixed
+// so the loops over the pixels don't check them
+template <bool Invert, class Rng>
+static void drawSamples(const uint8_t* image, int stride, const Raster& raster, int targetCount, unsigned char black, const double* lookup, int mode, Rng& g, int frameNumber, int threads, std::vector<int>& pixels, SampleScratch& scratch) {
+    if (threads > 1 && !isStippleMode(mode)) {
+        if (isGridMode(mode)) {
+            int period = 1 << (mode - 2);
+            sampleByBands<Invert, true>(image, stride, raster, period, frameNumber % period, lookup, black, targetCount, g, threads, pixels, scratch);
         }
         else {
-            // Advance by a small but randomized amount of pixels
-            // This means we don't have to re-shuffle each time, making the algorithm significantly faster
-            index += rand() % 32;
+            sampleByBands<Invert, false>(image, stride, raster, 1, 0, lookup, black, targetCount, g, threads, pixels, scratch);
         }
+        return;
+    }
 
-        // If we've advanced past the end of the candidate list...
-        if (index >= candidates.size()) {
-            // Loop back through
-            index = index % candidates.size();
-
-            if (mode == 1) {
-                // Increase greed a decent amount, breaking out relatively quickly
-                greed = greed * 1.05;
-                if (greed > 5) break;
-            }
-            else if (mode == 2) {
-                // super duper stipply
-                greed = greed * 1.05;
-                if (greed > 2) break;
-            }
-            else {
-                // Increase greed a bit, breaking out if it's big enough to prevent potential infinite loops
-                greed = greed * 1.01;
-                if (greed > 2) break;
-            }
-        }
+    if (isStippleMode(mode)) {
+        sampleByStipple<Invert>(image, stride, raster, scratch.tiles, scratch.scaled, black, mode == 2 ? std::max(1, targetCount / 2) : targetCount, frameNumber, g, pixels, scratch.candidates);
     }
+    else if (isGridMode(mode)) {
+        int period = 1 << (mode - 2);
+        scratch.candidateCount = sampleByHistogram<Invert, true>(image, stride, raster, scratch.tiles, period, frameNumber % period, lookup, black, targetCount, g, pixels, scratch.candidates, scratch.swaps);
+        scratch.positionCount = gridPositions(raster, period, frameNumber % period);
+    }
+    else if (scratch.scale > 1) {
+        sampleByLevel<Invert>(image, stride, raster, scratch.scale, lookup, black, targetCount, g, pixels, scratch);
+    }
+    else {
+        drawFromBuckets(scratch.buckets, scratch.candidates, raster, 0, lookup, targetCount, g, pixels, scratch.swaps);
+    }
+}
+
+// Get <image> ready for choosePixelsInto (see prepareSamples). Row y of the image starts at
+// image[y * stride]. The histogram modes are split between <threads> threads if it's more than 1.
+static void prepareImage(const uint8_t* image, int stride, const Raster& raster, int targetCount, unsigned char black, const double* lookup, int mode, bool invert, int threads, SampleScratch& scratch) {
+    if (invert) prepareSamples<true>(image, stride, raster, targetCount, black, lookup, mode, threads, scratch);
+    else prepareSamples<false>(image, stride, raster, targetCount, black, lookup, mode, threads, scratch);
+}
+
+// Choose <targetCount> pixels into <pixels> (see choosePixels) from the image last given to prepareImage,
+// using the curve in <lookup>. <image> and the rest have to be what they were then. <scratch> is working
+// space, and both keep their capacity for the next frame. Returns how many pixels were chosen before the
+// list was padded out with repeats.
+template <class Rng>
+static int choosePixelsInto(const uint8_t* image, int stride, const Raster& raster, int targetCount, unsigned char black, const double* lookup, int mode, Rng& g, int frameNumber, bool invert, int threads, std::vector<int>& pixels, SampleScratch& scratch) {
+    int s;
+
+    // This will be the list of chosen pixels
+    pixels.clear();
+    pixels.reserve(targetCount * 2);
+
+    if (invert) drawSamples<true>(image, stride, raster, targetCount, black, lookup, mode, g, frameNumber, threads, pixels, scratch);
+    else drawSamples<false>(image, stride, raster, targetCount, black, lookup, mode, g, frameNumber, threads, pixels, scratch);
 
     // Return the finalized list of chosen candidates' X and Y coordinates.
     s = pixels.size();
+    int chosen = s / 2;
     if (s == 0) {
         pixels.push_back(0);
         pixels.push_back(0);
@@ -252,6 +1112,20 @@ std::vector<int> choosePixels(const std::vector<unsigned char>& image, int targe
         pixels.push_back(pixels[ct++]);
         s = pixels.size();
     }
+    return chosen;
+}
+
+// Choose <targetCount> pixels from <image> that are greater than <black>, skewing towards <white> with a curve factor of <curve> then boosting everything by <boost>.
+template <class Rng>
+std::vector<int> choosePixels(const std::vector<unsigned char>& image, int targetCount, unsigned char black, unsigned char white, double boost, double curve, int mode, Rng& g, int frameNumber, bool invert) {
+    double lookup[256];
+    makeLookup(black, white, boost, curve, lookup);
+
+    std::vector<int> pixels;
+    SampleScratch scratch;
+    Raster raster(PIX_CT, PIX_CT);
+    prepareImage(image.data(), PIX_CT, raster, targetCount, black, lookup, mode, invert, 1, scratch);
+    choosePixelsInto(image.data(), PIX_CT, raster, targetCount, black, lookup, mode, g, frameNumber, invert, 1, pixels, scratch);
     return pixels;
 }
 
@@ -269,88 +1143,1385 @@ void debug(std::string s) {
     std::cout << s << std::endl;
 }
 
-// Find an order through which the pixels should be traversed and convert it into 16-bit PCM audio
-std::vector<int16_t> determinePath(std::vector<int>& pixelsOriginal, int targetCount, int jumpPeriod, int searchDistance, std::mt19937& rng)
-{
-	if (pixelsOriginal.size() == 0) {
-		std::vector<int16_t> ret;
-		ret.reserve(targetCount * 2);
-		for (int i = 0; i < targetCount * 2; i++) {
-			ret[i] = 0;
-		}
-		return ret;
-	}
-    std::vector<int16_t> path;
-    path.resize(targetCount * 2, 0);
+// Passes finished strokes on to a SampleSink as soon as they're done, if there is one
+struct StrokeEmitter {
+    const SampleSink* sink;
+    int emitted = 0;
 
-    int pathLength = 0;
-    int nPix = targetCount;
-    long x;
-    long y;
+    // Send the points of <path> up to <pathLength> that haven't been sent yet
+    void flush(const std::vector<int16_t>& path, int pathLength) {
+        if (sink != nullptr && pathLength > emitted) {
+            (*sink)(path.data() + emitted * 2, pathLength - emitted);
+            emitted = pathLength;
+        }
+    }
+};
+
+// Occupancy bitboard of the points that haven't been routed yet. Each row of the
+// image is <words> 64-bit words with one bit per pixel, and a per-pixel count
+// keeps track of duplicate points so the bit is only cleared once they're all used.
+// A black frame pads every point onto one pixel, so the counts need the full 32 bits.
+struct PointGrid {
+    int width, height, words;
+    std::vector<uint64_t> bits;
+    std::vector<uint32_t> counts;
 
-    std::vector<int> indices;
-    indices.resize(pixelsOriginal.size() / 2);
-    for (int i = 0; i < indices.size(); i++) {
-        indices[i] = i;
+    PointGrid(int width, int height)
+        : width(width), height(height), words((width + 63) / 64), bits(height * words, 0), counts(width * height, 0) {}
+
+    void add(int x, int y) {
+        counts[y * width + x]++;
+        bits[y * words + (x >> 6)] |= 1ULL << (x & 63);
     }
-    std::shuffle(indices.begin(), indices.end(), rng);
-    for (int i = 0; i < indices.size(); i++) {
-        pixelsOriginal[indices[i] * 2] = (pixelsOriginal[indices[i] * 2] - PIX_CT / 2) * SHRT_MAX / (PIX_CT);
-        pixelsOriginal[indices[i] * 2 + 1] = -((pixelsOriginal[indices[i] * 2 + 1] - PIX_CT / 2) * SHRT_MAX / (PIX_CT)) - 1;
+
+    // Take one point out of the given pixel, returns false if there wasn't one left
+    bool take(int x, int y) {
+        uint32_t& c = counts[y * width + x];
+        if (c == 0) return false;
+        if (--c == 0) bits[y * words + (x >> 6)] &= ~(1ULL << (x & 63));
+        return true;
     }
+};
 
-    long sD = (searchDistance) * SHRT_MAX / (PIX_CT);
-    sD = (sD * sD) + (sD * sD);
+// Working space for the routing, kept from one frame to the next by a HilligossEngine
+struct RouteScratch {
+    // Only made the first time grid routing is used. Every point gets taken back out of it by the end
+    // of a frame, so it's always empty between frames.
+    std::optional<PointGrid> grid;
+    std::vector<int> order, orderTemp;
+    std::vector<uint32_t> keys, keysTemp;
+    std::vector<int16_t> xs, ys;
+    // How many strokes the routing has started, how many points they had between them, and how many
+    // nearest point searches it's made, for HilligossStats. They keep adding up until they're reset.
+    int strokes = 0;
+    long strokePoints = 0;
+    long searches = 0;
+};
 
-    long dist;
+// Find the first set bit in <row> between <from> and <to> inclusive, or -1 if there isn't one
+static int firstSetAtOrAfter(const uint64_t* row, int from, int to) {
+    if (from > to) return -1;
+    int w = from >> 6;
+    int lastW = to >> 6;
+    uint64_t word = row[w] & (~0ULL << (from & 63));
+    while (true) {
+        if (word) {
+            int x = (w << 6) + std::countr_zero(word);
+            return x <= to ? x : -1;
+        }
+        if (++w > lastW) return -1;
+        word = row[w];
+    }
+}
 
-    // While we haven't hit the target count, and while there are still pixels on the map...
-    while (pathLength < targetCount && nPix > 0)
-    {
-        // Add that starting point to the path
-        path[pathLength * 2] = (pixelsOriginal[0]);
-        path[pathLength * 2 + 1] = (pixelsOriginal[1]);
-        pathLength++;
+// Find the last set bit in <row> between <to> and <from> inclusive (searching downwards), or -1 if there isn't one
+static int lastSetAtOrBefore(const uint64_t* row, int from, int to) {
+    if (from < to) return -1;
+    int w = from >> 6;
+    int lastW = to >> 6;
+    uint64_t word = row[w] & (~0ULL >> (63 - (from & 63)));
+    while (true) {
+        if (word) {
+            int x = (w << 6) + 63 - std::countl_zero(word);
+            return x >= to ? x : -1;
+        }
+        if (--w < lastW) return -1;
+        word = row[w];
+    }
+}
 
-        // Remove the starting point from the map
-        nPix--;
-        pixelsOriginal[0] = pixelsOriginal[nPix * 2];
-        pixelsOriginal[1] = pixelsOriginal[nPix * 2 + 1];
+// Find the closest remaining point to (<px>, <py>) that isn't on the same pixel, with a squared
+// distance below <limit>. Rows are searched outwards from <py>, and each row only needs a
+// couple of word scans to find the nearest set bit on either side of <px>, so the search
+// stops as soon as the rows are further away than the best point found so far.
+static bool nearestInGrid(const PointGrid& grid, int px, int py, long limit, int& outX, int& outY) {
+    long best = limit;
+    bool found = false;
 
-        for (int jumpCounter = 0; jumpCounter < jumpPeriod && pathLength < targetCount; jumpCounter++)
-        {
-            // Closest index is invalid for now
-            long closestIndex = -1;
-
-            // Closest distance is infinite for now
-            long minDistance = LONG_MAX;
-
-            for (int pixel = 0; pixel < nPix; pixel++) {
-                x = (path[(pathLength * 2 - 2)]);
-                y = (path[(pathLength * 2 - 1)]);
-                // Calculate the distance to the current pixel (sqrt(dx^2 + dy^2))
-                dist = (pixelsOriginal[pixel * 2] - x) * (pixelsOriginal[pixel * 2] - x)
-                    + (pixelsOriginal[pixel * 2 + 1] - y) * (pixelsOriginal[pixel * 2 + 1] - y);
-                // If it's a new record for the closest point
-                if (dist < sD && ((dist > 0) && (dist <= minDistance)))
-                {
-                    // Set the closest index and distance to the new record point
-                    closestIndex = pixel;
-                    minDistance = dist;
-                }
-            }
+    for (int dy = 0; (long)dy * dy < best; dy++) {
+        for (int side = 0; side < (dy == 0 ? 1 : 2); side++) {
+            int y = side == 0 ? py + dy : py - dy;
+            if (y < 0 || y >= grid.height) continue;
 
-            // If we found a pixel
-            if (closestIndex >= 0)
-            {
-                // Add it to the path
-                path[pathLength * 2] = (pixelsOriginal[closestIndex * 2]);
-                path[pathLength * 2 + 1] = (pixelsOriginal[closestIndex * 2 + 1]);
-                pathLength++;
+            // Largest horizontal offset that could still beat the current best
+            long remaining = best - (long)dy * dy;
+            if (remaining <= 0) continue;
+            int maxDx = (int)std::sqrt((double)remaining);
+            while ((long)maxDx * maxDx >= remaining) maxDx--;
 
-                nPix--;
-                pixelsOriginal[closestIndex * 2] = pixelsOriginal[nPix * 2];
-                pixelsOriginal[closestIndex * 2 + 1] = pixelsOriginal[nPix * 2 + 1];
+            const uint64_t* row = &grid.bits[y * grid.words];
+
+            // Skip the starting pixel itself, since duplicates of it can't be used to continue the stroke
+            int rightFrom = dy == 0 ? px + 1 : px;
+            int right = firstSetAtOrAfter(row, rightFrom, std::min(grid.width - 1, px + maxDx));
+            if (right >= 0) maxDx = right - px;
+            int left = lastSetAtOrBefore(row, px - 1, std::max(0, px - maxDx));
+
+            int x = -1;
+            if (left >= 0 && (right < 0 || px - left < right - px)) x = left;
+            else if (right >= 0) x = right;
+            if (x < 0) continue;
+
+            long dist = (long)(x - px) * (x - px) + (long)dy * dy;
+            if (dist < best) {
+                best = dist;
+                outX = x;
+                outY = y;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+// Same greedy nearest-neighbour routing as determinePath, but the remaining points are kept in
+// an occupancy bitboard so each step only looks at the neighbourhood of the current point
+// instead of scanning every remaining pixel.
+template <class Rng>
+static void determinePathGrid(const std::vector<int>& pixelsOriginal, int targetCount, int jumpPeriod, int searchDistance, Rng& rng, const Raster& raster, StrokeEmitter& emitter, std::vector<int16_t>& path, RouteScratch& scratch)
+{
+    path.assign(targetCount * 2, 0);
+
+    int nPix = std::min(targetCount, (int)(pixelsOriginal.size() / 2));
+
+    if (!scratch.grid || scratch.grid->width != raster.width || scratch.grid->height != raster.height) {
+        scratch.grid.emplace(raster.width, raster.height);
+    }
+    PointGrid& grid = *scratch.grid;
+    std::vector<int>& order = scratch.order;
+    order.resize(nPix);
+    for (int i = 0; i < nPix; i++) {
+        grid.add(pixelsOriginal[i * 2], pixelsOriginal[i * 2 + 1]);
+        order[i] = i;
+    }
+
+    // Stroke starting points are taken from a shuffled list, skipping any that were already used up
+    std::shuffle(order.begin(), order.end(), rng);
+    int nextStart = 0;
+
+    // Matches the radius used by the brute force search, but in pixels instead of sample units
+    long limit = 2L * searchDistance * searchDistance;
+
+    int pathLength = 0;
+    int x, y;
+    while (pathLength < targetCount && nPix > 0)
+    {
+        // The last stroke is finished, so it can be sent off
+        emitter.flush(path, pathLength);
+
+        // Find the next point that hasn't been used yet
+        bool started = false;
+        while (nextStart < (int)order.size() && !started) {
+            int p = order[nextStart++];
+            x = pixelsOriginal[p * 2];
+            y = pixelsOriginal[p * 2 + 1];
+            started = grid.take(x, y);
+        }
+        if (!started) break;
+        scratch.strokes++;
+        nPix--;
+
+        path[pathLength * 2] = raster.sampleX(x);
+        path[pathLength * 2 + 1] = raster.sampleY(y);
+        pathLength++;
+
+        for (int jumpCounter = 0; jumpCounter < jumpPeriod && pathLength < targetCount; jumpCounter++)
+        {
+            int nx, ny;
+            scratch.searches++;
+            if (!nearestInGrid(grid, x, y, limit, nx, ny)) break;
+
+            grid.take(nx, ny);
+            nPix--;
+            x = nx;
+            y = ny;
+
+            path[pathLength * 2] = raster.sampleX(x);
+            path[pathLength * 2 + 1] = raster.sampleY(y);
+            pathLength++;
+        }
+    }
+    scratch.strokePoints += pathLength;
+}
+
+// Position of (<x>, <y>) along a Hilbert curve covering a <size> x <size> square (a power of 2)
+static uint32_t hilbertIndex(int x, int y, int size) {
+    uint32_t d = 0;
+    for (int s = size / 2; s > 0; s /= 2) {
+        int rx = (x & s) > 0;
+        int ry = (y & s) > 0;
+        d += (uint32_t)s * s * ((3 * rx) ^ ry);
+
+        // Rotate the quadrant so the curve lines up with the next level down
+        if (ry == 0) {
+            if (rx == 1) {
+                x = size - 1 - x;
+                y = size - 1 - y;
+            }
+            std::swap(x, y);
+        }
+    }
+    return d;
+}
+
+// Sort <order> by <keys> (LSD radix sort, 8 bits per pass), keys are reordered along with it. The
+// temporary vectors are working space.
+static void radixSortByKey(std::vector<uint32_t>& keys, std::vector<int>& order, std::vector<uint32_t>& keysTemp, std::vector<int>& orderTemp) {
+    keysTemp.resize(keys.size());
+    orderTemp.resize(order.size());
+    uint32_t maxKey = keys.empty() ? 0 : *std::max_element(keys.begin(), keys.end());
+
+    for (int shift = 0; shift < 32 && (maxKey >> shift) > 0; shift += 8) {
+        int offsets[257] = { 0 };
+        for (uint32_t k : keys) offsets[((k >> shift) & 255) + 1]++;
+        for (int i = 0; i < 256; i++) offsets[i + 1] += offsets[i];
+        for (size_t i = 0; i < keys.size(); i++) {
+            int dst = offsets[(keys[i] >> shift) & 255]++;
+            keysTemp[dst] = keys[i];
+            orderTemp[dst] = order[i];
+        }
+        keys.swap(keysTemp);
+        order.swap(orderTemp);
+    }
+}
+
+// How many upcoming points along the curve are checked when picking the next point in a stroke
+#define CURVE_WINDOW 16
+
+// Order the points along a Hilbert curve, then walk that order, picking the closest of the next
+// CURVE_WINDOW points each time instead of searching every remaining point. Points the curve
+// visits close together are close together in the image, so this makes strokes that are nearly
+// as good as the greedy search in determinePath for a fraction of the work.
+static void determinePathCurve(const std::vector<int>& pixelsOriginal, int targetCount, int jumpPeriod, int searchDistance, const Raster& raster, StrokeEmitter& emitter, std::vector<int16_t>& path, RouteScratch& scratch)
+{
+    path.assign(targetCount * 2, 0);
+
+    int nPix = std::min(targetCount, (int)(pixelsOriginal.size() / 2));
+
+    std::vector<uint32_t>& keys = scratch.keys;
+    std::vector<int>& order = scratch.order;
+    keys.resize(nPix);
+    order.resize(nPix);
+    for (int i = 0; i < nPix; i++) {
+        keys[i] = hilbertIndex(pixelsOriginal[i * 2], pixelsOriginal[i * 2 + 1], raster.curveSide);
+        order[i] = i;
+    }
+    radixSortByKey(keys, order, scratch.keysTemp, scratch.orderTemp);
+
+    // Matches the radius used by the brute force search, but in pixels instead of sample units
+    long limit = 2L * searchDistance * searchDistance;
+
+    int jumpCounter = 0;
+    for (int i = 0; i < nPix; i++) {
+        // Pull the closest point in the window up to the current position, unless this is the start of a new stroke
+        if (i > 0 && jumpCounter < jumpPeriod) {
+            int px = pixelsOriginal[order[i - 1] * 2];
+            int py = pixelsOriginal[order[i - 1] * 2 + 1];
+            int closest = -1;
+            long minDistance = limit;
+            scratch.searches++;
+            for (int j = i; j < std::min(nPix, i + CURVE_WINDOW); j++) {
+                long dx = pixelsOriginal[order[j] * 2] - px;
+                long dy = pixelsOriginal[order[j] * 2 + 1] - py;
+                long dist = dx * dx + dy * dy;
+                if (dist > 0 && dist < minDistance) {
+                    closest = j;
+                    minDistance = dist;
+                }
+            }
+            if (closest >= 0) {
+                std::swap(order[i], order[closest]);
+                jumpCounter++;
+            }
+            else {
+                jumpCounter = 0;
+                scratch.strokes++;
+                emitter.flush(path, i);
+            }
+        }
+        else {
+            jumpCounter = 0;
+            scratch.strokes++;
+            emitter.flush(path, i);
+        }
+
+        path[i * 2] = raster.sampleX(pixelsOriginal[order[i] * 2]);
+        path[i * 2 + 1] = raster.sampleY(pixelsOriginal[order[i] * 2 + 1]);
+    }
+    scratch.strokePoints += nPix;
+}
+
+// How many nearby points refinePath considers reconnecting each point to
+#define REFINE_NEIGHBOURS 8
+
+// Side length of the buckets refinePath uses to find nearby points, in pixels (must be a power of 2)
+#define REFINE_CELL 8
+
+// Fewest edges refinePath picks out to work through at once. Each lot is the longest of what's left,
+// pulled out with nth_element, so a pass only sorts as far as the time budget lets it get.
+#define REFINE_BATCH 1024
+
+// Working state for refinePath. Points keep their id for the whole pass, <order> is the
+// current route through them and <position> is where each id currently sits in it. A
+// HilligossEngine keeps one from frame to frame so the buffers don't have to be made again.
+struct RefineState {
+    int n;
+    std::vector<int> xs, ys;
+    std::vector<int> order, position;
+
+    // Points bucketed by cell for the neighbour search, computed lazily per point
+    int cells;
+    std::vector<int> cellStart, cellPoints, cellFill;
+    std::vector<int> neighbours;
+    std::vector<bool> hasNeighbours;
+    std::vector<std::pair<double, int>> found;
+
+    // Each edge's squared length and the id of the point it starts at, and a copy of the path to put
+    // back together in the new order
+    std::vector<std::pair<long, int>> edges;
+    std::vector<int16_t> original;
+
+    double dist(int a, int b) const {
+        double dx = xs[a] - xs[b];
+        double dy = ys[a] - ys[b];
+        return std::sqrt(dx * dx + dy * dy);
+    }
+
+    // Distance between the points at two positions in the route
+    double edge(int i, int j) const {
+        return dist(order[i], order[j]);
+    }
+
+    // The same squared, which sorts the same way without the square root
+    long squaredEdge(int i, int j) const {
+        long dx = xs[order[i]] - xs[order[j]];
+        long dy = ys[order[i]] - ys[order[j]];
+        return dx * dx + dy * dy;
+    }
+
+    int cellOf(int x, int y) const {
+        return (y / REFINE_CELL) * cells + (x / REFINE_CELL);
+    }
+
+    const int* neighboursOf(int p) {
+        int* result = &neighbours[p * REFINE_NEIGHBOURS];
+        if (hasNeighbours[p]) return result;
+        hasNeighbours[p] = true;
+
+        // Grow the search a ring of cells at a time until there's enough candidates, then one more
+        // ring so that points just over a cell boundary aren't missed
+        int cx = xs[p] / REFINE_CELL;
+        int cy = ys[p] / REFINE_CELL;
+        found.clear();
+        int extraRings = 1;
+        for (int r = 0; r < cells && extraRings >= 0; r++) {
+            for (int y = std::max(0, cy - r); y <= std::min(cells - 1, cy + r); y++) {
+                for (int x = std::max(0, cx - r); x <= std::min(cells - 1, cx + r); x++) {
+                    if (std::max(std::abs(x - cx), std::abs(y - cy)) != r) continue;
+                    int c = y * cells + x;
+                    for (int k = cellStart[c]; k < cellStart[c + 1]; k++) {
+                        int q = cellPoints[k];
+                        if (q != p) found.push_back({ dist(p, q), q });
+                    }
+                }
+            }
+            if (found.size() >= REFINE_NEIGHBOURS) extraRings--;
+        }
+
+        int count = std::min((int)found.size(), REFINE_NEIGHBOURS);
+        std::partial_sort(found.begin(), found.begin() + count, found.end());
+        for (int k = 0; k < REFINE_NEIGHBOURS; k++) {
+            result[k] = k < count ? found[k].second : -1;
+        }
+        return result;
+    }
+
+    void updatePositions(int from, int to) {
+        for (int i = from; i <= to; i++) position[order[i]] = i;
+    }
+};
+
+// Try to reconnect the edge between route positions <i> and <i + 1> to one of the neighbours of
+// the point at <i>, applying the first move that shortens the route. Returns how much shorter it
+// made the route, or 0 if it didn't find a move.
+static double improveEdge(RefineState& st, int i) {
+    int a = st.order[i];
+    int b = st.order[i + 1];
+    double ab = st.dist(a, b);
+    const double epsilon = 1e-6;
+
+    const int* near = st.neighboursOf(a);
+    for (int k = 0; k < REFINE_NEIGHBOURS; k++) {
+        int c = near[k];
+        if (c < 0) break;
+        double ac = st.dist(a, c);
+        if (ac >= ab) break;
+        int j = st.position[c];
+        if (j == i + 1) continue;
+
+        // 2-opt: reverse the section between the two edges so that a connects straight to c
+        if (j > i + 1) {
+            // a b ... c d  ->  a c ... b d
+            double removed = ab + (j + 1 < st.n ? st.edge(j, j + 1) : 0);
+            double added = ac + (j + 1 < st.n ? st.dist(b, st.order[j + 1]) : 0);
+            if (added < removed - epsilon) {
+                std::reverse(st.order.begin() + i + 1, st.order.begin() + j + 1);
+                st.updatePositions(i + 1, j);
+                return removed - added;
+            }
+        }
+        else {
+            // e c ... a b  ->  e a ... c b
+            double removed = ab + (j > 0 ? st.edge(j - 1, j) : 0);
+            double added = st.dist(c, b) + (j > 0 ? st.dist(st.order[j - 1], a) : 0);
+            if (added < removed - epsilon) {
+                std::reverse(st.order.begin() + j, st.order.begin() + i + 1);
+                st.updatePositions(j, i);
+                return removed - added;
+            }
+        }
+
+        // Or-opt: move a short run of points starting at c in between a and b, either way round
+        for (int len = 1; len <= 3; len++) {
+            int end = j + len - 1;
+            if (j < 1 || end + 1 >= st.n) break;
+            if (j <= i + 1 && end >= i) break;
+            int first = st.order[j];
+            int last = st.order[end];
+            int before = st.order[j - 1];
+            int after = st.order[end + 1];
+
+            double removed = ab + st.dist(before, first) + st.dist(last, after);
+            double forwards = st.dist(a, first) + st.dist(last, b);
+            double backwards = st.dist(a, last) + st.dist(first, b);
+            double added = std::min(forwards, backwards) + st.dist(before, after);
+            if (added < removed - epsilon) {
+                int insertAt;
+                if (j > i) {
+                    std::rotate(st.order.begin() + i + 1, st.order.begin() + j, st.order.begin() + end + 1);
+                    insertAt = i + 1;
+                    st.updatePositions(i + 1, end);
+                }
+                else {
+                    std::rotate(st.order.begin() + j, st.order.begin() + end + 1, st.order.begin() + i + 1);
+                    insertAt = i - len + 1;
+                    st.updatePositions(j, i);
+                }
+                if (backwards < forwards) {
+                    std::reverse(st.order.begin() + insertAt, st.order.begin() + insertAt + len);
+                    st.updatePositions(insertAt, insertAt + len - 1);
+                }
+                return removed - added;
+            }
+        }
+    }
+    return 0;
+}
+
+// refinePath, with <st> to work in
+static void refinePathWith(RefineState& st, std::vector<int16_t>& path, int pointCount, int budgetMicroseconds, HilligossStats* stats, const Raster& raster) {
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::microseconds(budgetMicroseconds);
+
+    st.n = std::min(pointCount, (int)(path.size() / 2));
+    if (st.n < 4) {
+        if (stats != nullptr) stats->jumpLengthBefore = stats->jumpLengthAfter = 0;
+        return;
+    }
+
+    // Convert the samples back into pixels and measure the route on the way. If there's a budget and
+    // this much uses it up, leave the path as it is.
+    st.xs.resize(st.n);
+    st.ys.resize(st.n);
+    st.order.resize(st.n);
+    st.position.resize(st.n);
+    double before = 0;
+    for (int p = 0; p < st.n; p++) {
+        st.xs[p] = raster.pixelX(path[p * 2]);
+        st.ys[p] = raster.pixelY(path[p * 2 + 1]);
+        st.order[p] = p;
+        st.position[p] = p;
+        if (p > 0) before += st.dist(p - 1, p);
+        if ((p & 4095) == 4095 && budgetMicroseconds > 0 && std::chrono::steady_clock::now() >= deadline) {
+            if (stats != nullptr) stats->jumpLengthBefore = stats->jumpLengthAfter = 0;
+            return;
+        }
+    }
+    double shortened = 0;
+
+    // Writing the new order back takes about as long as getting this far did, so stop improving the
+    // route early enough to leave time for it
+    auto stopBy = deadline - (std::chrono::steady_clock::now() - start);
+    auto outOfTime = [&stopBy]() {
+        return std::chrono::steady_clock::now() >= stopBy;
+    };
+
+    if (budgetMicroseconds > 0 && !outOfTime()) {
+        // Bucket the points by cell
+        st.cells = (raster.side + REFINE_CELL - 1) / REFINE_CELL;
+        st.cellStart.assign(st.cells * st.cells + 1, 0);
+        st.cellPoints.resize(st.n);
+        for (int p = 0; p < st.n; p++) st.cellStart[st.cellOf(st.xs[p], st.ys[p]) + 1]++;
+        for (int c = 0; c < st.cells * st.cells; c++) st.cellStart[c + 1] += st.cellStart[c];
+        st.cellFill.assign(st.cellStart.begin(), st.cellStart.end() - 1);
+        for (int p = 0; p < st.n; p++) st.cellPoints[st.cellFill[st.cellOf(st.xs[p], st.ys[p])]++] = p;
+        st.neighbours.resize(st.n * REFINE_NEIGHBOURS);
+        st.hasNeighbours.assign(st.n, false);
+
+        // Work through the edges longest first, starting over whenever a whole pass finds nothing. The
+        // edges are picked out a batch at a time, which comes out in the same order as sorting them all.
+        std::vector<std::pair<long, int>>& edges = st.edges;
+        size_t batch = std::max(REFINE_BATCH, st.n / 16);
+        bool improved = true;
+        bool stopped = outOfTime();
+        int checks = 0;
+        while (improved && !stopped) {
+            improved = false;
+            edges.clear();
+            for (int i = 0; i + 1 < st.n && !stopped; i++) {
+                edges.push_back({ st.squaredEdge(i, i + 1), st.order[i] });
+                if ((i & 4095) == 4095) stopped = outOfTime();
+            }
+
+            for (size_t from = 0; from < edges.size() && !stopped; from += batch) {
+                size_t to = std::min(edges.size(), from + batch);
+                std::nth_element(edges.begin() + from, edges.begin() + to - 1, edges.end(), std::greater<>());
+                std::sort(edges.begin() + from, edges.begin() + to, std::greater<>());
+
+                for (size_t k = from; k < to; k++) {
+                    if ((++checks & 7) == 0 && outOfTime()) {
+                        stopped = true;
+                        break;
+                    }
+
+                    // The route may have changed since the list was made, so find where the point is now
+                    int i = st.position[edges[k].second];
+                    if (i + 1 >= st.n) continue;
+                    double gain = improveEdge(st, i);
+                    if (gain > 0) {
+                        improved = true;
+                        shortened += gain;
+                    }
+                }
+            }
+        }
+
+        // Write the new order back into the path, unless the setup alone used up the budget
+        if (shortened > 0 && std::chrono::steady_clock::now() < deadline) {
+            st.original.assign(path.begin(), path.begin() + st.n * 2);
+            for (int i = 0; i < st.n; i++) {
+                path[i * 2] = st.original[st.order[i] * 2];
+                path[i * 2 + 1] = st.original[st.order[i] * 2 + 1];
+            }
+        }
+        else {
+            shortened = 0;
+        }
+    }
+
+    if (stats != nullptr) {
+        stats->jumpLengthBefore = before;
+        stats->jumpLengthAfter = before - shortened;
+    }
+}
+
+void refinePath(std::vector<int16_t>& path, int pointCount, int budgetMicroseconds, HilligossStats* stats, int width, int height) {
+    RefineState st;
+    refinePathWith(st, path, pointCount, budgetMicroseconds, stats, Raster(width, height));
+}
+
+// Taps each upsamplePath filter uses, and how many phases its filter bank can have at most
+#define UPSAMPLE_SINC_TAPS 16
+#define UPSAMPLE_MAX_PHASES 4096
+
+// Weight of the input sample <d> input samples away from an output sample, for <filter>
+static double upsampleKernel(int filter, double d) {
+    d = std::fabs(d);
+    if (filter == UPSAMPLE_LINEAR) {
+        return std::max(0.0, 1 - d);
+    }
+    if (filter == UPSAMPLE_CUBIC) {
+        // Catmull-Rom, which goes through the points, so corners in the path stay where they were
+        if (d < 1) return 1.5 * d * d * d - 2.5 * d * d + 1;
+        if (d < 2) return -0.5 * d * d * d + 2.5 * d * d - 4 * d + 2;
+        return 0;
+    }
+    // Sinc with a Blackman window over the taps
+    double half = UPSAMPLE_SINC_TAPS / 2;
+    if (d >= half) return 0;
+    double sinc = d < 1e-9 ? 1 : std::sin(M_PI * d) / (M_PI * d);
+    return sinc * (0.42 + 0.5 * std::cos(M_PI * d / half) + 0.08 * std::cos(2 * M_PI * d / half));
+}
+
+// upsamplePath with the number of taps fixed, so the inner loop is a dot product of a known length that
+// the compiler can vectorize and unroll. Output sample m lands at m * inputRate / outputRate input
+// samples in, worked out in whole numbers so it never drifts. Its fractional part picks the phase of the
+// filter bank, which is exact whenever the rates have few enough phases between them. Positions are
+// 64-bit, since m * inputRate passes 2^31 within a second of output and long is 32-bit on Windows.
+template <int Taps>
+static std::vector<int16_t> upsampleWith(const std::vector<int16_t>& samples, int64_t inputRate, int64_t outputRate, int filter) {
+    int64_t inCount = (int64_t)samples.size() / 2;
+    int64_t outCount = inCount * outputRate / inputRate;
+    int64_t phases = std::min<int64_t>(outputRate / std::gcd(inputRate, outputRate), UPSAMPLE_MAX_PHASES);
+
+    // Filter bank, each phase's taps adding up to 1 so a still beam stays exactly where it is
+    std::vector<float> bank(phases * Taps);
+    for (int64_t phase = 0; phase < phases; phase++) {
+        double frac = (double)phase / phases;
+        double total = 0;
+        for (int k = 0; k < Taps; k++) total += upsampleKernel(filter, k - Taps / 2 + 1 - frac);
+        for (int k = 0; k < Taps; k++) bank[phase * Taps + k] = (float)(upsampleKernel(filter, k - Taps / 2 + 1 - frac) / total);
+    }
+
+    // Split the channels, with the first and last points repeated past the ends so every window fits
+    std::vector<float> xs(inCount + Taps * 2), ys(inCount + Taps * 2);
+    for (int64_t j = 0; j < inCount + Taps * 2; j++) {
+        int64_t from = std::clamp<int64_t>(j - Taps, 0, inCount - 1);
+        xs[j] = samples[from * 2];
+        ys[j] = samples[from * 2 + 1];
+    }
+
+    std::vector<int16_t> output(outCount * 2);
+    for (int64_t m = 0; m < outCount; m++) {
+        int64_t position = m * inputRate;
+        int64_t i = position / outputRate;
+        const float* taps = &bank[(position % outputRate) * phases / outputRate * Taps];
+        const float* x = &xs[i - Taps / 2 + 1 + Taps];
+        const float* y = &ys[i - Taps / 2 + 1 + Taps];
+        float sx = 0, sy = 0;
+        for (int k = 0; k < Taps; k++) {
+            sx += taps[k] * x[k];
+            sy += taps[k] * y[k];
+        }
+        output[m * 2] = (int16_t)std::clamp(std::lrint(sx), -32768L, 32767L);
+        output[m * 2 + 1] = (int16_t)std::clamp(std::lrint(sy), -32768L, 32767L);
+    }
+    return output;
+}
+
+std::vector<int16_t> upsamplePath(const std::vector<int16_t>& samples, int inputRate, int outputRate, int filter) {
+    if (inputRate < 1 || outputRate <= inputRate || samples.size() < 2) {
+        return samples;
+    }
+    if (filter == UPSAMPLE_LINEAR) return upsampleWith<2>(samples, inputRate, outputRate, filter);
+    if (filter == UPSAMPLE_SINC) return upsampleWith<UPSAMPLE_SINC_TAPS>(samples, inputRate, outputRate, filter);
+    return upsampleWith<4>(samples, inputRate, outputRate, UPSAMPLE_CUBIC);
+}
+
+// Vectorized blocks of the closest point search below. Each one runs over as many whole blocks
+// of <xs>/<ys> as fit in <n>, returns how many points it covered, and leaves each lane's best
+// distance and index in <laneDist>/<laneIndex>. The coordinates fit in 16 bits and so does the
+// difference between two of them, so dx and dy are interleaved and squared-and-summed into 32
+// bits with one multiply-add. Ties keep the highest index, same as the scalar loop.
+#define MAX_KERNEL_LANES 16
+
+#if SIMD_DISPATCH || defined(__AVX512BW__)
+TARGET_AVX512 static int closestPointBlocksAvx512(const int16_t* xs, const int16_t* ys, int n, int px, int py, int32_t sD, int32_t* laneDist, int32_t* laneIndex) {
+    const __m512i vpx = _mm512_set1_epi16((int16_t)px);
+    const __m512i vpy = _mm512_set1_epi16((int16_t)py);
+    const __m512i vsD = _mm512_set1_epi32(sD);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i step = _mm512_set1_epi32(32);
+
+    // unpacklo/hi work within each 128 bit lane, so the point indices end up interleaved like this
+    __m512i indexLo = _mm512_setr_epi32(0, 1, 2, 3, 8, 9, 10, 11, 16, 17, 18, 19, 24, 25, 26, 27);
+    __m512i indexHi = _mm512_setr_epi32(4, 5, 6, 7, 12, 13, 14, 15, 20, 21, 22, 23, 28, 29, 30, 31);
+    __m512i bestLo = _mm512_set1_epi32(INT32_MAX), bestHi = bestLo;
+    __m512i bestIndexLo = _mm512_set1_epi32(-1), bestIndexHi = bestIndexLo;
+
+    int pixel = 0;
+    for (; pixel + 32 <= n; pixel += 32) {
+        __m512i dx = _mm512_sub_epi16(_mm512_loadu_si512(xs + pixel), vpx);
+        __m512i dy = _mm512_sub_epi16(_mm512_loadu_si512(ys + pixel), vpy);
+        __m512i lo = _mm512_unpacklo_epi16(dx, dy);
+        __m512i hi = _mm512_unpackhi_epi16(dx, dy);
+        __m512i distLo = _mm512_madd_epi16(lo, lo);
+        __m512i distHi = _mm512_madd_epi16(hi, hi);
+
+        __mmask16 betterLo = _mm512_cmpgt_epi32_mask(distLo, zero) & _mm512_cmplt_epi32_mask(distLo, vsD) & _mm512_cmple_epi32_mask(distLo, bestLo);
+        __mmask16 betterHi = _mm512_cmpgt_epi32_mask(distHi, zero) & _mm512_cmplt_epi32_mask(distHi, vsD) & _mm512_cmple_epi32_mask(distHi, bestHi);
+        bestLo = _mm512_mask_mov_epi32(bestLo, betterLo, distLo);
+        bestHi = _mm512_mask_mov_epi32(bestHi, betterHi, distHi);
+        bestIndexLo = _mm512_mask_mov_epi32(bestIndexLo, betterLo, indexLo);
+        bestIndexHi = _mm512_mask_mov_epi32(bestIndexHi, betterHi, indexHi);
+
+        indexLo = _mm512_add_epi32(indexLo, step);
+        indexHi = _mm512_add_epi32(indexHi, step);
+    }
+
+    // Fold the two halves together so the caller only has 16 lanes to look at
+    __mmask16 takeHi = _mm512_cmplt_epi32_mask(bestHi, bestLo) | (_mm512_cmpeq_epi32_mask(bestHi, bestLo) & _mm512_cmpgt_epi32_mask(bestIndexHi, bestIndexLo));
+    _mm512_storeu_si512(laneDist, _mm512_mask_mov_epi32(bestLo, takeHi, bestHi));
+    _mm512_storeu_si512(laneIndex, _mm512_mask_mov_epi32(bestIndexLo, takeHi, bestIndexHi));
+    return pixel;
+}
+#endif
+
+#if SIMD_DISPATCH || (defined(__AVX2__) && !defined(__AVX512BW__))
+TARGET_AVX2 static inline void updateBestAvx2(__m256i dist, __m256i index, __m256i& best, __m256i& bestIndex, __m256i sD) {
+    __m256i valid = _mm256_and_si256(_mm256_cmpgt_epi32(dist, _mm256_setzero_si256()), _mm256_cmpgt_epi32(sD, dist));
+    __m256i better = _mm256_andnot_si256(_mm256_cmpgt_epi32(dist, best), valid);
+    best = _mm256_blendv_epi8(best, dist, better);
+    bestIndex = _mm256_blendv_epi8(bestIndex, index, better);
+}
+
+TARGET_AVX2 static int closestPointBlocksAvx2(const int16_t* xs, const int16_t* ys, int n, int px, int py, int32_t sD, int32_t* laneDist, int32_t* laneIndex) {
+    const __m256i vpx = _mm256_set1_epi16((int16_t)px);
+    const __m256i vpy = _mm256_set1_epi16((int16_t)py);
+    const __m256i vsD = _mm256_set1_epi32(sD);
+    const __m256i step = _mm256_set1_epi32(16);
+
+    // unpacklo/hi work within each 128 bit lane, so the point indices end up interleaved like this
+    __m256i indexLo = _mm256_setr_epi32(0, 1, 2, 3, 8, 9, 10, 11);
+    __m256i indexHi = _mm256_setr_epi32(4, 5, 6, 7, 12, 13, 14, 15);
+    __m256i bestLo = _mm256_set1_epi32(INT32_MAX), bestHi = bestLo;
+    __m256i bestIndexLo = _mm256_set1_epi32(-1), bestIndexHi = bestIndexLo;
+
+    int pixel = 0;
+    for (; pixel + 16 <= n; pixel += 16) {
+        __m256i dx = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(xs + pixel)), vpx);
+        __m256i dy = _mm256_sub_epi16(_mm256_loadu_si256((const __m256i*)(ys + pixel)), vpy);
+        __m256i lo = _mm256_unpacklo_epi16(dx, dy);
+        __m256i hi = _mm256_unpackhi_epi16(dx, dy);
+        updateBestAvx2(_mm256_madd_epi16(lo, lo), indexLo, bestLo, bestIndexLo, vsD);
+        updateBestAvx2(_mm256_madd_epi16(hi, hi), indexHi, bestHi, bestIndexHi, vsD);
+        indexLo = _mm256_add_epi32(indexLo, step);
+        indexHi = _mm256_add_epi32(indexHi, step);
+    }
+
+    _mm256_storeu_si256((__m256i*)laneDist, bestLo);
+    _mm256_storeu_si256((__m256i*)(laneDist + 8), bestHi);
+    _mm256_storeu_si256((__m256i*)laneIndex, bestIndexLo);
+    _mm256_storeu_si256((__m256i*)(laneIndex + 8), bestIndexHi);
+    return pixel;
+}
+#endif
+
+#if SIMD_DISPATCH
+// SSE4.1's blendv does the choosing in updateBest in one instruction instead of three
+TARGET_SSE42 static inline void updateBestSse42(__m128i dist, __m128i index, __m128i& best, __m128i& bestIndex, __m128i sD) {
+    __m128i valid = _mm_and_si128(_mm_cmpgt_epi32(dist, _mm_setzero_si128()), _mm_cmpgt_epi32(sD, dist));
+    __m128i better = _mm_andnot_si128(_mm_cmpgt_epi32(dist, best), valid);
+    best = _mm_blendv_epi8(best, dist, better);
+    bestIndex = _mm_blendv_epi8(bestIndex, index, better);
+}
+
+TARGET_SSE42 static int closestPointBlocksSse42(const int16_t* xs, const int16_t* ys, int n, int px, int py, int32_t sD, int32_t* laneDist, int32_t* laneIndex) {
+    const __m128i vpx = _mm_set1_epi16((int16_t)px);
+    const __m128i vpy = _mm_set1_epi16((int16_t)py);
+    const __m128i vsD = _mm_set1_epi32(sD);
+    const __m128i step = _mm_set1_epi32(8);
+
+    __m128i indexLo = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i indexHi = _mm_setr_epi32(4, 5, 6, 7);
+    __m128i bestLo = _mm_set1_epi32(INT32_MAX), bestHi = bestLo;
+    __m128i bestIndexLo = _mm_set1_epi32(-1), bestIndexHi = bestIndexLo;
+
+    int pixel = 0;
+    for (; pixel + 8 <= n; pixel += 8) {
+        __m128i dx = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(xs + pixel)), vpx);
+        __m128i dy = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(ys + pixel)), vpy);
+        __m128i lo = _mm_unpacklo_epi16(dx, dy);
+        __m128i hi = _mm_unpackhi_epi16(dx, dy);
+        updateBestSse42(_mm_madd_epi16(lo, lo), indexLo, bestLo, bestIndexLo, vsD);
+        updateBestSse42(_mm_madd_epi16(hi, hi), indexHi, bestHi, bestIndexHi, vsD);
+        indexLo = _mm_add_epi32(indexLo, step);
+        indexHi = _mm_add_epi32(indexHi, step);
+    }
+
+    _mm_storeu_si128((__m128i*)laneDist, bestLo);
+    _mm_storeu_si128((__m128i*)(laneDist + 4), bestHi);
+    _mm_storeu_si128((__m128i*)laneIndex, bestIndexLo);
+    _mm_storeu_si128((__m128i*)(laneIndex + 4), bestIndexHi);
+    std::fill(laneDist + 8, laneDist + MAX_KERNEL_LANES, INT32_MAX);
+    return pixel;
+}
+#endif
+
+#if defined(__SSE2__) && !defined(__AVX2__)
+static inline void updateBestSse2(__m128i dist, __m128i index, __m128i& best, __m128i& bestIndex, __m128i sD) {
+    __m128i valid = _mm_and_si128(_mm_cmpgt_epi32(dist, _mm_setzero_si128()), _mm_cmpgt_epi32(sD, dist));
+    __m128i better = _mm_andnot_si128(_mm_cmpgt_epi32(dist, best), valid);
+    best = _mm_or_si128(_mm_and_si128(better, dist), _mm_andnot_si128(better, best));
+    bestIndex = _mm_or_si128(_mm_and_si128(better, index), _mm_andnot_si128(better, bestIndex));
+}
+
+static int closestPointBlocksSse2(const int16_t* xs, const int16_t* ys, int n, int px, int py, int32_t sD, int32_t* laneDist, int32_t* laneIndex) {
+    const __m128i vpx = _mm_set1_epi16((int16_t)px);
+    const __m128i vpy = _mm_set1_epi16((int16_t)py);
+    const __m128i vsD = _mm_set1_epi32(sD);
+    const __m128i step = _mm_set1_epi32(8);
+
+    __m128i indexLo = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i indexHi = _mm_setr_epi32(4, 5, 6, 7);
+    __m128i bestLo = _mm_set1_epi32(INT32_MAX), bestHi = bestLo;
+    __m128i bestIndexLo = _mm_set1_epi32(-1), bestIndexHi = bestIndexLo;
+
+    int pixel = 0;
+    for (; pixel + 8 <= n; pixel += 8) {
+        __m128i dx = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(xs + pixel)), vpx);
+        __m128i dy = _mm_sub_epi16(_mm_loadu_si128((const __m128i*)(ys + pixel)), vpy);
+        __m128i lo = _mm_unpacklo_epi16(dx, dy);
+        __m128i hi = _mm_unpackhi_epi16(dx, dy);
+        updateBestSse2(_mm_madd_epi16(lo, lo), indexLo, bestLo, bestIndexLo, vsD);
+        updateBestSse2(_mm_madd_epi16(hi, hi), indexHi, bestHi, bestIndexHi, vsD);
+        indexLo = _mm_add_epi32(indexLo, step);
+        indexHi = _mm_add_epi32(indexHi, step);
+    }
+
+    _mm_storeu_si128((__m128i*)laneDist, bestLo);
+    _mm_storeu_si128((__m128i*)(laneDist + 4), bestHi);
+    _mm_storeu_si128((__m128i*)laneIndex, bestIndexLo);
+    _mm_storeu_si128((__m128i*)(laneIndex + 4), bestIndexHi);
+    std::fill(laneDist + 8, laneDist + MAX_KERNEL_LANES, INT32_MAX);
+    return pixel;
+}
+#endif
+
+// The closest point blocks with whatever the compiler is targeting
+static int closestPointBlocksGeneric(const int16_t* xs, const int16_t* ys, int n, int px, int py, int32_t sD, int32_t* laneDist, int32_t* laneIndex) {
+#if defined(__AVX512BW__)
+    return closestPointBlocksAvx512(xs, ys, n, px, py, sD, laneDist, laneIndex);
+#elif defined(__AVX2__)
+    return closestPointBlocksAvx2(xs, ys, n, px, py, sD, laneDist, laneIndex);
+#elif defined(__SSE2__)
+    return closestPointBlocksSse2(xs, ys, n, px, py, sD, laneDist, laneIndex);
+#elif defined(__ARM_NEON)
+    const int16x8_t vpx = vdupq_n_s16((int16_t)px);
+    const int16x8_t vpy = vdupq_n_s16((int16_t)py);
+    const int32x4_t vsD = vdupq_n_s32(sD);
+    const int32x4_t zero = vdupq_n_s32(0);
+    const int32x4_t step = vdupq_n_s32(8);
+
+    const int32_t lo[4] = { 0, 1, 2, 3 };
+    const int32_t hi[4] = { 4, 5, 6, 7 };
+    int32x4_t indexLo = vld1q_s32(lo);
+    int32x4_t indexHi = vld1q_s32(hi);
+    int32x4_t bestLo = vdupq_n_s32(INT32_MAX), bestHi = bestLo;
+    int32x4_t bestIndexLo = vdupq_n_s32(-1), bestIndexHi = bestIndexLo;
+
+    int pixel = 0;
+    for (; pixel + 8 <= n; pixel += 8) {
+        int16x8_t dx = vsubq_s16(vld1q_s16(xs + pixel), vpx);
+        int16x8_t dy = vsubq_s16(vld1q_s16(ys + pixel), vpy);
+        int32x4_t distLo = vmlal_s16(vmull_s16(vget_low_s16(dx), vget_low_s16(dx)), vget_low_s16(dy), vget_low_s16(dy));
+        int32x4_t distHi = vmlal_s16(vmull_s16(vget_high_s16(dx), vget_high_s16(dx)), vget_high_s16(dy), vget_high_s16(dy));
+
+        uint32x4_t betterLo = vandq_u32(vandq_u32(vcgtq_s32(distLo, zero), vcltq_s32(distLo, vsD)), vcleq_s32(distLo, bestLo));
+        uint32x4_t betterHi = vandq_u32(vandq_u32(vcgtq_s32(distHi, zero), vcltq_s32(distHi, vsD)), vcleq_s32(distHi, bestHi));
+        bestLo = vbslq_s32(betterLo, distLo, bestLo);
+        bestHi = vbslq_s32(betterHi, distHi, bestHi);
+        bestIndexLo = vbslq_s32(betterLo, indexLo, bestIndexLo);
+        bestIndexHi = vbslq_s32(betterHi, indexHi, bestIndexHi);
+
+        indexLo = vaddq_s32(indexLo, step);
+        indexHi = vaddq_s32(indexHi, step);
+    }
+
+    vst1q_s32(laneDist, bestLo);
+    vst1q_s32(laneDist + 4, bestHi);
+    vst1q_s32(laneIndex, bestIndexLo);
+    vst1q_s32(laneIndex + 4, bestIndexHi);
+    std::fill(laneDist + 8, laneDist + MAX_KERNEL_LANES, INT32_MAX);
+    return pixel;
+#else
+    // Scalar fallback, the loop in closestPoint does all the work
+    std::fill(laneDist, laneDist + MAX_KERNEL_LANES, INT32_MAX);
+    return 0;
+#endif
+}
+
+static bool always() {
+    return true;
+}
+
+#if SIMD_DISPATCH
+static bool hasSse42() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2");
+}
+
+static bool hasAvx2() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool hasAvx512() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+#endif
+
+// Every build of the kernels, best last. They all give exactly the same results, only faster or slower.
+static const SimdKernels simdVariants[] = {
+    { "baseline", always, { liveMasksGeneric<false>, liveMasksGeneric<true> }, closestPointBlocksGeneric },
+#if SIMD_DISPATCH
+    { "sse4.2", hasSse42, { liveMasksSse42<false>, liveMasksSse42<true> }, closestPointBlocksSse42 },
+    { "avx2", hasAvx2, { liveMasksAvx2<false>, liveMasksAvx2<true> }, closestPointBlocksAvx2 },
+    { "avx512", hasAvx512, { liveMasksAvx512<false>, liveMasksAvx512<true> }, closestPointBlocksAvx512 },
+#endif
+};
+
+// The kernels being used, or null until they're first needed
+static std::atomic<const SimdKernels*> activeKernels{ nullptr };
+
+// The build of the kernels called <name>, or null if there isn't one or this CPU can't run it
+static const SimdKernels* findSimdVariant(const std::string& name) {
+    for (const SimdKernels& variant : simdVariants) {
+        if (name == variant.name) return variant.supported() ? &variant : nullptr;
+    }
+    return nullptr;
+}
+
+// The kernels to use. The first time through they're picked from the HILLIGOSS_SIMD environment
+// variable if it names some this CPU can run, and otherwise they're the best it can run.
+static const SimdKernels& simdKernels() {
+    const SimdKernels* kernels = activeKernels.load(std::memory_order_acquire);
+    if (kernels != nullptr) return *kernels;
+
+    const char* forced = std::getenv("HILLIGOSS_SIMD");
+    const SimdKernels* picked = forced != nullptr ? findSimdVariant(forced) : nullptr;
+    if (picked == nullptr) {
+        for (const SimdKernels& variant : simdVariants) {
+            if (variant.supported()) picked = &variant;
+        }
+    }
+
+    // Another thread (or setSimdVariant) might have got there first, in which case theirs stands
+    if (!activeKernels.compare_exchange_strong(kernels, picked, std::memory_order_acq_rel)) return *kernels;
+    return *picked;
+}
+
+const char* simdVariant() {
+    return simdKernels().name;
+}
+
+bool setSimdVariant(const std::string& name) {
+    const SimdKernels* variant = findSimdVariant(name);
+    if (variant == nullptr) return false;
+    activeKernels.store(variant, std::memory_order_release);
+    return true;
+}
+
+// Find the closest of the <n> points in <xs>/<ys> to (<px>, <py>), only counting points with a squared
+// distance above 0 and below <sD>. Returns -1 if there isn't one, and the highest index if there's a tie.
+static int closestPoint(const int16_t* xs, const int16_t* ys, int n, int px, int py, int32_t sD) {
+    int32_t laneDist[MAX_KERNEL_LANES];
+    int32_t laneIndex[MAX_KERNEL_LANES];
+    int pixel = simdKernels().closestPointBlocks(xs, ys, n, px, py, sD, laneDist, laneIndex);
+
+    // Reduce the lanes down to one winner
+    int32_t minDistance = INT32_MAX;
+    int closestIndex = -1;
+    for (int i = 0; i < MAX_KERNEL_LANES; i++) {
+        if (laneDist[i] == INT32_MAX) continue;
+        if (laneDist[i] < minDistance || (laneDist[i] == minDistance && laneIndex[i] > closestIndex)) {
+            minDistance = laneDist[i];
+            closestIndex = laneIndex[i];
+        }
+    }
+
+    // Finish off whatever didn't fit in a whole block
+    for (; pixel < n; pixel++) {
+        // Calculate the distance to the current pixel (sqrt(dx^2 + dy^2))
+        int32_t dist = (xs[pixel] - px) * (xs[pixel] - px) + (ys[pixel] - py) * (ys[pixel] - py);
+        // If it's a new record for the closest point
+        if (dist < sD && dist > 0 && dist <= minDistance) {
+            closestIndex = pixel;
+            minDistance = dist;
+        }
+    }
+    return closestIndex;
+}
+
+template <class Rng>
+static void routePath(std::vector<int>& pixelsOriginal, int targetCount, int jumpPeriod, int searchDistance, Rng& rng, int routing, int routeThreads, const PathHistory* previous, const SampleSink* sink, const Raster& raster, std::vector<int16_t>& path, RouteScratch& scratch);
+
+// Fewest points worth giving a tile of its own in determinePathTiled
+#define MIN_TILE_POINTS 256
+
+// Split the points into <tiles> spatially compact tiles by cutting the Hilbert curve order into equal
+// runs, route each tile on its own thread, then join the tiles end to end. Tiles are joined greedily,
+// picking whichever remaining tile has an end closest to where the last one finished (flipping it
+// if that end is its last point). The tiles' counts are added to <scratch>.
+template <class Rng>
+static std::vector<int16_t> determinePathTiled(const std::vector<int>& pixelsOriginal, int targetCount, int jumpPeriod, int searchDistance, Rng& rng, int routing, int tiles, const Raster& raster, RouteScratch& scratch)
+{
+    int nPix = std::min(targetCount, (int)(pixelsOriginal.size() / 2));
+
+    std::vector<uint32_t> keys(nPix);
+    std::vector<int> order(nPix);
+    for (int i = 0; i < nPix; i++) {
+        keys[i] = hilbertIndex(pixelsOriginal[i * 2], pixelsOriginal[i * 2 + 1], raster.curveSide);
+        order[i] = i;
+    }
+    std::vector<uint32_t> keysTemp;
+    std::vector<int> orderTemp;
+    radixSortByKey(keys, order, keysTemp, orderTemp);
+
+    std::vector<std::vector<int>> tilePixels(tiles);
+    std::vector<std::vector<int16_t>> tilePaths(tiles);
+    std::vector<Rng> tileRngs;
+    for (int t = 0; t < tiles; t++) {
+        int start = (int)((long)nPix * t / tiles);
+        int end = (int)((long)nPix * (t + 1) / tiles);
+        tilePixels[t].reserve((end - start) * 2);
+        for (int i = start; i < end; i++) {
+            tilePixels[t].push_back(pixelsOriginal[order[i] * 2]);
+            tilePixels[t].push_back(pixelsOriginal[order[i] * 2 + 1]);
+        }
+        tileRngs.push_back(Rng{ (unsigned)rng() });
+    }
+
+    // Route the tiles, the first one on this thread
+    std::vector<RouteScratch> tileScratch(tiles);
+    auto routeTile = [&](int t) {
+        routePath(tilePixels[t], (int)tilePixels[t].size() / 2, jumpPeriod, searchDistance, tileRngs[t], routing, 1, nullptr, nullptr, raster, tilePaths[t], tileScratch[t]);
+    };
+    std::vector<std::thread> workers;
+    for (int t = 1; t < tiles; t++) {
+        workers.push_back(std::thread(routeTile, t));
+    }
+    routeTile(0);
+    for (std::thread& w : workers) {
+        w.join();
+    }
+    for (const RouteScratch& tile : tileScratch) {
+        scratch.strokes += tile.strokes;
+        scratch.strokePoints += tile.strokePoints;
+        scratch.searches += tile.searches;
+    }
+
+    // Stitch the tiles together
+    std::vector<int16_t> path;
+    path.reserve(targetCount * 2);
+    std::vector<bool> used(tiles, false);
+    for (int joined = 0; joined < tiles; joined++) {
+        int best = -1;
+        bool flip = false;
+        long bestDistance = LONG_MAX;
+        for (int t = 0; t < tiles; t++) {
+            if (used[t]) continue;
+            const std::vector<int16_t>& tp = tilePaths[t];
+            if (path.empty()) {
+                best = t;
+                break;
+            }
+            long x = path[path.size() - 2];
+            long y = path[path.size() - 1];
+            long toStart = (tp[0] - x) * (tp[0] - x) + (tp[1] - y) * (tp[1] - y);
+            long toEnd = (tp[tp.size() - 2] - x) * (tp[tp.size() - 2] - x) + (tp[tp.size() - 1] - y) * (tp[tp.size() - 1] - y);
+            if (toStart < bestDistance) {
+                best = t;
+                flip = false;
+                bestDistance = toStart;
+            }
+            if (toEnd < bestDistance) {
+                best = t;
+                flip = true;
+                bestDistance = toEnd;
+            }
+        }
+
+        used[best] = true;
+        const std::vector<int16_t>& tp = tilePaths[best];
+        if (flip) {
+            for (int i = (int)tp.size() / 2 - 1; i >= 0; i--) {
+                path.push_back(tp[i * 2]);
+                path.push_back(tp[i * 2 + 1]);
+            }
+        }
+        else {
+            path.insert(path.end(), tp.begin(), tp.end());
+        }
+    }
+
+    path.resize(targetCount * 2, 0);
+    return path;
+}
+
+// How far a point can be from one on the previous frame's path and still count as the same point, in
+// pixels, and how far apart two points that follow each other in a warm started stroke can be
+#define WARM_MATCH_DISTANCE 8
+
+// If more than this fraction of the points don't match the previous frame, it's treated as a scene cut
+#define WARM_CUT_FRACTION 0.5
+
+// Size of the cells the ends of warm started strokes are bucketed into while they're joined up, in pixels
+#define WARM_JOIN_CELL 32
+
+// Squared distance between points <a> and <b> of <samples>
+static int64_t sampleDistance2(const std::vector<int16_t>& samples, int a, int b) {
+    int64_t dx = samples[a * 2] - samples[b * 2];
+    int64_t dy = samples[a * 2 + 1] - samples[b * 2 + 1];
+    return dx * dx + dy * dy;
+}
+
+// Total distance between the first <count> points of <samples>, in sample units
+static double sampleTravel(const std::vector<int16_t>& samples, int count) {
+    double travel = 0;
+    for (int p = 1; p < count; p++) travel += std::sqrt((double)sampleDistance2(samples, p - 1, p));
+    return travel;
+}
+
+// Order the points by following the previous frame's path. Each point is matched to the closest point on
+// the old path (using a map from pixels to old points), and the matched points are put in the same order
+// as the points they matched. Anything that didn't match is new, so those get routed from scratch. Both
+// are cut into strokes wherever one point is more than WARM_MATCH_DISTANCE from the next (which is where
+// the old path jumped, or where the image changed under it) or a stroke reaches <jumpPeriod> points, and
+// the strokes are joined up nearest end first. If too much of the frame is new, it's a scene cut and the
+// whole frame is routed normally. Points can match a busy frame whatever came before it though, so if
+// following the old path comes out longer than the old path was, the frame is routed normally as well and
+// whichever is shorter is kept. The routing uses <scratch>.
+template <class Rng>
+static std::vector<int16_t> determinePathWarm(std::vector<int>& pixelsOriginal, int targetCount, int jumpPeriod, int searchDistance, Rng& rng, int routing, int routeThreads, const PathHistory& previous, const Raster& raster, RouteScratch& scratch)
+{
+    std::vector<int16_t> path;
+
+    int nPix = std::min(targetCount, (int)(pixelsOriginal.size() / 2));
+    int previousCount = (int)previous.samples.size() / 2;
+
+    // A copy for routing the frame normally, so it comes out just as it would have without a warm start
+    Rng coldRng = rng;
+    auto routeCold = [&](std::vector<int16_t>& into) {
+        routePath(pixelsOriginal, targetCount, jumpPeriod, searchDistance, coldRng, routing, routeThreads, nullptr, nullptr, raster, into, scratch);
+    };
+
+    // Which old point is on each pixel, if any
+    std::vector<int> lookup(raster.width * raster.height, -1);
+    for (int p = 0; p < previousCount; p++) {
+        lookup[raster.pixelY(previous.samples[p * 2 + 1]) * raster.width + raster.pixelX(previous.samples[p * 2])] = p;
+    }
+
+    // Match every new point to the closest old one, searching outwards a ring of pixels at a time
+    std::vector<int> match(nPix, -1);
+    int unmatched = 0;
+    for (int i = 0; i < nPix; i++) {
+        int x = pixelsOriginal[i * 2];
+        int y = pixelsOriginal[i * 2 + 1];
+        int minDistance = WARM_MATCH_DISTANCE * WARM_MATCH_DISTANCE + 1;
+        for (int r = 0; r <= WARM_MATCH_DISTANCE && r * r < minDistance; r++) {
+            for (int ny = std::max(0, y - r); ny <= std::min(raster.height - 1, y + r); ny++) {
+                // Only the edges of the ring, the inside has been checked already
+                int step = (ny == y - r || ny == y + r || r == 0) ? 1 : 2 * r;
+                for (int nx = x - r; nx <= x + r; nx += step) {
+                    if (nx < 0 || nx >= raster.width) continue;
+                    int p = lookup[ny * raster.width + nx];
+                    if (p < 0) continue;
+                    int dist = (nx - x) * (nx - x) + (ny - y) * (ny - y);
+                    if (dist < minDistance) {
+                        minDistance = dist;
+                        match[i] = p;
+                    }
+                }
+            }
+        }
+
+        // Scene cut, start over
+        if (match[i] < 0 && ++unmatched > nPix * WARM_CUT_FRACTION) {
+            routeCold(path);
+            return path;
+        }
+    }
+
+    // Sort the matched points by where their match was on the old path
+    std::vector<int> orderStart(previousCount + 1, 0);
+    for (int i = 0; i < nPix; i++) {
+        if (match[i] >= 0) orderStart[match[i] + 1]++;
+    }
+    for (int p = 0; p < previousCount; p++) orderStart[p + 1] += orderStart[p];
+    std::vector<int> order(nPix - unmatched);
+    std::vector<int> changed;
+    changed.reserve(unmatched * 2);
+    for (int i = 0; i < nPix; i++) {
+        if (match[i] >= 0) {
+            order[orderStart[match[i]]++] = i;
+        }
+        else {
+            changed.push_back(pixelsOriginal[i * 2]);
+            changed.push_back(pixelsOriginal[i * 2 + 1]);
+        }
+    }
+
+    std::vector<int16_t> followed;
+    followed.reserve(nPix * 2);
+    for (int i : order) {
+        followed.push_back(raster.sampleX(pixelsOriginal[i * 2]));
+        followed.push_back(raster.sampleY(pixelsOriginal[i * 2 + 1]));
+    }
+
+    // Route the parts of the image that changed, to be cut up along with the rest. The strokes that get
+    // counted are the ones it's cut into.
+    int strokesBefore = scratch.strokes;
+    long pointsBefore = scratch.strokePoints;
+    if (unmatched > 0) {
+        std::vector<int16_t> rest;
+        routePath(changed, unmatched, jumpPeriod, searchDistance, rng, routing, routeThreads, nullptr, nullptr, raster, rest, scratch);
+        followed.insert(followed.end(), rest.begin(), rest.end());
+    }
+
+    // Cut it into strokes
+    int64_t step = (int64_t)WARM_MATCH_DISTANCE * SHRT_MAX * 2 / raster.side;
+    int64_t maxStep2 = step * step;
+    std::vector<int> strokeStart;
+    for (int p = 0; p < nPix; p++) {
+        if (p == 0 || p - strokeStart.back() > jumpPeriod || sampleDistance2(followed, p - 1, p) > maxStep2) strokeStart.push_back(p);
+    }
+    int strokes = (int)strokeStart.size();
+    strokeStart.push_back(nPix);
+
+    // Bucket the ends of the strokes by cell, end e being the start of stroke e / 2 if e is even and
+    // its finish if it's odd
+    int cellsX = (raster.width + WARM_JOIN_CELL - 1) / WARM_JOIN_CELL;
+    int cellsY = (raster.height + WARM_JOIN_CELL - 1) / WARM_JOIN_CELL;
+    std::vector<int> endX(strokes * 2), endY(strokes * 2);
+    std::vector<int> cellStart(cellsX * cellsY + 1, 0);
+    for (int e = 0; e < strokes * 2; e++) {
+        int p = e & 1 ? strokeStart[e / 2 + 1] - 1 : strokeStart[e / 2];
+        endX[e] = raster.pixelX(followed[p * 2]);
+        endY[e] = raster.pixelY(followed[p * 2 + 1]);
+        cellStart[(endY[e] / WARM_JOIN_CELL) * cellsX + endX[e] / WARM_JOIN_CELL + 1]++;
+    }
+    for (int c = 0; c < cellsX * cellsY; c++) cellStart[c + 1] += cellStart[c];
+    std::vector<int> cellEnds(strokes * 2);
+    std::vector<int> filled(cellStart.begin(), cellStart.end() - 1);
+    for (int e = 0; e < strokes * 2; e++) {
+        cellEnds[filled[(endY[e] / WARM_JOIN_CELL) * cellsX + endX[e] / WARM_JOIN_CELL]++] = e;
+    }
+
+    // Join them up, going to whichever end of a stroke is closest to where the last one finished. The
+    // cells are searched a ring at a time, until the next ring is further away than the best end so far.
+    path.reserve(targetCount * 2);
+    std::vector<bool> used(strokes, false);
+    int best = 0;
+    for (int joined = 0; joined < strokes; joined++) {
+        if (joined > 0) {
+            int x = endX[best ^ 1], y = endY[best ^ 1];
+            int cx = x / WARM_JOIN_CELL, cy = y / WARM_JOIN_CELL;
+            int bestDistance = INT_MAX;
+            for (int r = 0; r < std::max(cellsX, cellsY); r++) {
+                if (r > 0 && (r - 1) * (r - 1) * WARM_JOIN_CELL * WARM_JOIN_CELL >= bestDistance) break;
+                for (int ny = std::max(0, cy - r); ny <= std::min(cellsY - 1, cy + r); ny++) {
+                    // Only the edges of the ring, the inside has been searched already
+                    int step = (ny == cy - r || ny == cy + r || r == 0) ? 1 : 2 * r;
+                    for (int nx = cx - r; nx <= cx + r; nx += step) {
+                        if (nx < 0 || nx >= cellsX) continue;
+                        int c = ny * cellsX + nx;
+                        for (int k = cellStart[c]; k < cellStart[c + 1]; k++) {
+                            int e = cellEnds[k];
+                            if (used[e / 2]) continue;
+                            int distance = (endX[e] - x) * (endX[e] - x) + (endY[e] - y) * (endY[e] - y);
+                            if (distance < bestDistance || (distance == bestDistance && e < best)) {
+                                best = e;
+                                bestDistance = distance;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        int s = best / 2;
+        used[s] = true;
+        if (best & 1) {
+            for (int p = strokeStart[s + 1] - 1; p >= strokeStart[s]; p--) {
+                path.push_back(followed[p * 2]);
+                path.push_back(followed[p * 2 + 1]);
+            }
+        }
+        else {
+            path.insert(path.end(), followed.begin() + strokeStart[s] * 2, followed.begin() + strokeStart[s + 1] * 2);
+        }
+    }
+    scratch.strokes = strokesBefore;
+    scratch.strokePoints = pointsBefore;
+
+    // Following the old path should never make the route longer than it was, so if it has, check whether
+    // routing the frame normally does any better and keep whichever is shorter
+    double travel = sampleTravel(path, nPix);
+    if (travel > sampleTravel(previous.samples, previousCount)) {
+        std::vector<int16_t> cold;
+        routeCold(cold);
+        if (sampleTravel(cold, nPix) < travel) {
+            path.swap(cold);
+            return path;
+        }
+        scratch.strokes = strokesBefore;
+        scratch.strokePoints = pointsBefore;
+    }
+    scratch.strokes += strokes;
+    scratch.strokePoints += nPix;
+
+    path.resize(targetCount * 2, 0);
+    return path;
+}
+
+// Greedy nearest-neighbour routing: each stroke starts at whatever point is first in the list, then keeps
+// moving to the closest remaining point until there isn't one within <searchDistance> or the stroke has
+// gone on for <jumpPeriod> points
+static void determinePathBrute(const std::vector<int>& pixelsOriginal, int targetCount, int jumpPeriod, int searchDistance, const Raster& raster, StrokeEmitter& emitter, std::vector<int16_t>& path, RouteScratch& scratch)
+{
+    path.assign(targetCount * 2, 0);
+	if (pixelsOriginal.size() == 0) {
+		return;
+	}
+
+    int pathLength = 0;
+    int nPix = std::min(targetCount, (int)(pixelsOriginal.size() / 2));
+
+    // Convert the pixels into sample coordinates (at half scale), stored as separate x and y arrays
+    // so the distance kernel can load a whole block of either at once
+    std::vector<int16_t>& xs = scratch.xs;
+    std::vector<int16_t>& ys = scratch.ys;
+    xs.resize(nPix);
+    ys.resize(nPix);
+    for (int i = 0; i < nPix; i++) {
+        xs[i] = (pixelsOriginal[i * 2] - raster.width / 2) * SHRT_MAX / raster.side;
+        ys[i] = -((pixelsOriginal[i * 2 + 1] - raster.height / 2) * SHRT_MAX / raster.side) - 1;
+    }
+
+    long sD = (searchDistance) * SHRT_MAX / raster.side;
+    sD = (sD * sD) + (sD * sD);
+    int32_t sD32 = (int32_t)std::min(sD, (long)INT32_MAX);
+
+    int x, y;
+
+    // While we haven't hit the target count, and while there are still pixels on the map...
+    while (pathLength < targetCount && nPix > 0)
+    {
+        // The last stroke is finished, so it can be sent off
+        emitter.flush(path, pathLength);
+
+        // Add that starting point to the path
+        scratch.strokes++;
+        x = xs[0];
+        y = ys[0];
+        path[pathLength * 2] = x * 2;
+        path[pathLength * 2 + 1] = y * 2;
+        pathLength++;
+
+        // Remove the starting point from the map
+        nPix--;
+        xs[0] = xs[nPix];
+        ys[0] = ys[nPix];
+
+        for (int jumpCounter = 0; jumpCounter < jumpPeriod && pathLength < targetCount; jumpCounter++)
+        {
+            scratch.searches++;
+            int closestIndex = closestPoint(xs.data(), ys.data(), nPix, x, y, sD32);
+
+            // If we found a pixel
+            if (closestIndex >= 0)
+            {
+                // Add it to the path
+                x = xs[closestIndex];
+                y = ys[closestIndex];
+                path[pathLength * 2] = x * 2;
+                path[pathLength * 2 + 1] = y * 2;
+                pathLength++;
+
+                nPix--;
+                xs[closestIndex] = xs[nPix];
+                ys[closestIndex] = ys[nPix];
             }
             // Otherwise, begin a new stroke
             else
@@ -359,7 +2530,258 @@ std::vector<int16_t> determinePath(std::vector<int>& pixelsOriginal, int targetC
             }
         }
     }
-    
-    for (int i = 0; i < path.size(); i++) path[i] *= 2;
+    scratch.strokePoints += pathLength;
+}
+
+// Find an order through which the pixels should be traversed and convert it into 16-bit PCM audio in <path>
+// (see determinePath), using the buffers in <scratch>
+template <class Rng>
+static void routePath(std::vector<int>& pixelsOriginal, int targetCount, int jumpPeriod, int searchDistance, Rng& rng, int routing, int routeThreads, const PathHistory* previous, const SampleSink* sink, const Raster& raster, std::vector<int16_t>& path, RouteScratch& scratch)
+{
+    StrokeEmitter emitter{ sink };
+
+    int tiles = std::min(routeThreads, std::min(targetCount, (int)(pixelsOriginal.size() / 2)) / MIN_TILE_POINTS);
+
+    if (previous != nullptr && !previous->samples.empty() && !pixelsOriginal.empty()) {
+        path = determinePathWarm(pixelsOriginal, targetCount, jumpPeriod, searchDistance, rng, routing, routeThreads, *previous, raster, scratch);
+    }
+    else if (tiles > 1) {
+        path = determinePathTiled(pixelsOriginal, targetCount, jumpPeriod, searchDistance, rng, routing, tiles, raster, scratch);
+    }
+    else if (routing == 1) {
+        determinePathGrid(pixelsOriginal, targetCount, jumpPeriod, searchDistance, rng, raster, emitter, path, scratch);
+    }
+    else if (routing == 2) {
+        determinePathCurve(pixelsOriginal, targetCount, jumpPeriod, searchDistance, raster, emitter, path, scratch);
+    }
+    else {
+        determinePathBrute(pixelsOriginal, targetCount, jumpPeriod, searchDistance, raster, emitter, path, scratch);
+    }
+
+    // Send off whatever hasn't been yet, including any padding on the end
+    emitter.flush(path, (int)path.size() / 2);
+}
+
+// Find an order through which the pixels should be traversed and convert it into 16-bit PCM audio
+template <class Rng>
+std::vector<int16_t> determinePath(std::vector<int>& pixelsOriginal, int targetCount, int jumpPeriod, int searchDistance, Rng& rng, int routing, int routeThreads, const PathHistory* previous, const SampleSink* sink)
+{
+    std::vector<int16_t> path;
+    RouteScratch scratch;
+    routePath(pixelsOriginal, targetCount, jumpPeriod, searchDistance, rng, routing, routeThreads, previous, sink, Raster(PIX_CT, PIX_CT), path, scratch);
     return path;
 }
+
+// Everything a HilligossEngine keeps from one frame to the next
+struct HilligossScratch {
+    std::vector<int> pixels;
+    SampleScratch sample;
+    std::vector<int16_t> path;
+    RouteScratch route;
+    RefineState refine;
+    // How long the last prepare() took, until a draw reports it
+    long long prepareNanoseconds = 0;
+    // Where the image the last prepare() was given starts and how far apart its rows are, so a draw of any
+    // other image (or with no prepare() before it at all) knows to prepare it first
+    const uint8_t* preparedImage = nullptr;
+    int preparedStride = 0;
+};
+
+// Nanoseconds from <start> to now
+static long long nanosecondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+template <class Rng>
+HilligossEngine<Rng>::HilligossEngine(const HilligossParams& params)
+    : params(params), border(params.borderSamples > 0 ? makeBorder(params.borderSamples) : std::vector<int16_t>()), scratch(std::make_unique<HilligossScratch>()) {
+    makeLookup(params.blackThreshold, params.whiteThreshold, params.boost, params.curve, lookup);
+}
+
+template <class Rng>
+HilligossEngine<Rng>::HilligossEngine(HilligossEngine&& other) noexcept = default;
+
+template <class Rng>
+HilligossEngine<Rng>& HilligossEngine<Rng>::operator=(HilligossEngine&& other) noexcept = default;
+
+template <class Rng>
+HilligossEngine<Rng>::~HilligossEngine() = default;
+
+template <class Rng>
+int HilligossEngine<Rng>::pointsPerFrame() const {
+    return params.targetCount + std::max(0, params.borderSamples);
+}
+
+template <class Rng>
+void HilligossEngine<Rng>::process(const std::vector<unsigned char>& image, std::vector<int16_t>& destination, int frameNumber, Rng rng, PathHistory* history, HilligossStats* stats) {
+    // Add the samples onto the end of the destination vector as they come in
+    destination.reserve(destination.size() + pointsPerFrame() * 2);
+    SampleSink sink = [&destination](const int16_t* samples, int count) {
+        destination.insert(destination.end(), samples, samples + count * 2);
+    };
+    processStream(image, params.width, sink, frameNumber, rng, history, stats);
+}
+
+template <class Rng>
+int HilligossEngine<Rng>::process(std::span<const uint8_t> image, int stride, std::span<int16_t> destination, int frameNumber, Rng rng, PathHistory* history, HilligossStats* stats) {
+    prepare(image, stride);
+    return draw(image, stride, destination, frameNumber, rng, history, stats);
+}
+
+template <class Rng>
+int HilligossEngine<Rng>::draw(std::span<const uint8_t> image, int stride, std::span<int16_t> destination, int frameNumber, Rng rng, PathHistory* history, HilligossStats* stats) {
+    // Copy the samples into the destination as they come in, dropping anything that doesn't fit. The sink
+    // only holds a pointer to where it's up to, which std::function can keep without allocating.
+    struct Filling {
+        std::span<int16_t> destination;
+        int written;
+    } filling = { destination, 0 };
+    SampleSink sink = [into = &filling](const int16_t* samples, int count) {
+        count = std::min(count, (int)(into->destination.size() / 2) - into->written);
+        std::copy(samples, samples + count * 2, into->destination.data() + into->written * 2);
+        into->written += count;
+    };
+    drawStream(image, stride, sink, frameNumber, rng, history, stats);
+    return filling.written;
+}
+
+template <class Rng>
+void HilligossEngine<Rng>::processStream(const std::vector<unsigned char>& image, const SampleSink& sink, int frameNumber, Rng rng, PathHistory* history, HilligossStats* stats) {
+    processStream(image, params.width, sink, frameNumber, rng, history, stats);
+}
+
+template <class Rng>
+void HilligossEngine<Rng>::processStream(std::span<const uint8_t> image, int stride, const SampleSink& sink, int frameNumber, Rng rng, PathHistory* history, HilligossStats* stats) {
+    prepare(image, stride);
+    drawStream(image, stride, sink, frameNumber, rng, history, stats);
+}
+
+template <class Rng>
+bool HilligossEngine<Rng>::fits(std::span<const uint8_t> image, int stride) const {
+    return params.width >= 1 && params.height >= 1 && stride >= params.width && image.size() >= (size_t)stride * (params.height - 1) + params.width;
+}
+
+template <class Rng>
+void HilligossEngine<Rng>::prepare(std::span<const uint8_t> image, int stride) {
+    const HilligossParams& p = params;
+
+    // Leave the image alone if its rows don't fit in it
+    if (!fits(image, stride)) {
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    prepareImage(image.data(), stride, Raster(p.width, p.height), p.targetCount, p.blackThreshold, lookup, p.mode, p.invert, p.sampleThreads, scratch->sample);
+    scratch->prepareNanoseconds = nanosecondsSince(start);
+    scratch->preparedImage = image.data();
+    scratch->preparedStride = stride;
+}
+
+template <class Rng>
+void HilligossEngine<Rng>::drawStream(std::span<const uint8_t> image, int stride, const SampleSink& sink, int frameNumber, Rng rng, PathHistory* history, HilligossStats* stats) {
+    const HilligossParams& p = params;
+
+    // Leave the image alone if its rows don't fit in it
+    Raster raster(p.width, p.height);
+    if (!fits(image, stride)) {
+        return;
+    }
+
+    // The sampling works from what prepare() found, so make sure that was this image
+    if (scratch->preparedImage != image.data() || scratch->preparedStride != stride) {
+        prepare(image, stride);
+    }
+
+    std::vector<int>& pixels = scratch->pixels;
+    std::vector<int16_t>& samples = scratch->path;
+    RouteScratch& route = scratch->route;
+
+    // Select a subset of pixels from the image
+    auto start = std::chrono::steady_clock::now();
+    int chosen = choosePixelsInto(image.data(), stride, raster, p.targetCount, p.blackThreshold, lookup, p.mode, forStage(rng, STAGE_CHOOSE), frameNumber, p.invert, p.sampleThreads, pixels, scratch->sample);
+    long long chooseNanoseconds = nanosecondsSince(start);
+
+    // Order the pixels and convert them into samples. Strokes go straight to the sink as they're
+    // finished, unless the path is going to be rearranged afterwards
+    auto routeStart = std::chrono::steady_clock::now();
+    route.strokes = 0;
+    route.strokePoints = 0;
+    route.searches = 0;
+    const SampleSink* streamTo = p.refineMicroseconds > 0 ? nullptr : &sink;
+    routePath(pixels, p.targetCount, p.jumpPeriod, p.searchDistance, forStage(rng, STAGE_ROUTE), p.routing, p.routeThreads, history, streamTo, raster, samples, route);
+    long long routeNanoseconds = nanosecondsSince(routeStart);
+
+    // Untangle the path, leaving out any padding on the end if there weren't enough pixels
+    auto refineStart = std::chrono::steady_clock::now();
+    int pointCount = std::min(p.targetCount, (int)(pixels.size() / 2));
+    if (p.refineMicroseconds > 0 || stats != nullptr) {
+        refinePathWith(scratch->refine, samples, pointCount, p.refineMicroseconds, stats, raster);
+    }
+
+    if (stats != nullptr) {
+        const SampleScratch& sample = scratch->sample;
+        stats->prepareNanoseconds = scratch->prepareNanoseconds;
+        stats->chooseNanoseconds = chooseNanoseconds;
+        stats->routeNanoseconds = routeNanoseconds;
+        stats->refineNanoseconds = nanosecondsSince(refineStart);
+        stats->totalNanoseconds = stats->prepareNanoseconds + nanosecondsSince(start);
+        stats->candidates = sample.candidateCount;
+        stats->rejected = sample.positionCount - sample.candidateCount;
+        stats->targetCount = p.targetCount;
+        stats->points = std::min(chosen, p.targetCount);
+        stats->strokes = route.strokes;
+        stats->meanStrokeLength = route.strokes > 0 ? (double)route.strokePoints / route.strokes : 0;
+        stats->searches = route.searches;
+    }
+    scratch->prepareNanoseconds = 0;
+
+    // Keep this frame's path around to start the next one from
+    if (history != nullptr) {
+        history->samples.assign(samples.begin(), samples.begin() + pointCount * 2);
+    }
+
+    if (streamTo == nullptr) {
+        sink(samples.data(), (int)samples.size() / 2);
+    }
+
+	if (!border.empty()) {
+		sink(border.data(), p.borderSamples);
+	}
+}
+
+template <class Rng>
+void hilligoss(const std::vector<unsigned char>& image, std::vector<int16_t>& destination, int targetCount, unsigned char blackThreshold, unsigned char whiteThreshold, int jumpPeriod, int searchDistance, double boost, double curve, int mode, int frameNumber, int borderSamples, bool invert, Rng rng, int routing, int routeThreads, int refineMicroseconds, PathHistory* history, HilligossStats* stats) {
+    HilligossEngine<Rng> engine(HilligossParams{ targetCount, blackThreshold, whiteThreshold, jumpPeriod, searchDistance, boost, curve, mode, borderSamples, invert, routing, routeThreads, refineMicroseconds });
+    engine.process(image, destination, frameNumber, rng, history, stats);
+}
+
+template <class Rng>
+int hilligoss(std::span<const uint8_t> image, int stride, std::span<int16_t> destination, int targetCount, unsigned char blackThreshold, unsigned char whiteThreshold, int jumpPeriod, int searchDistance, double boost, double curve, int mode, int frameNumber, int borderSamples, bool invert, Rng rng, int routing, int routeThreads, int refineMicroseconds, PathHistory* history, HilligossStats* stats) {
+    HilligossEngine<Rng> engine(HilligossParams{ targetCount, blackThreshold, whiteThreshold, jumpPeriod, searchDistance, boost, curve, mode, borderSamples, invert, routing, routeThreads, refineMicroseconds });
+    return engine.process(image, stride, destination, frameNumber, rng, history, stats);
+}
+
+template <class Rng>
+void hilligossStream(const std::vector<unsigned char>& image, const SampleSink& sink, int targetCount, unsigned char blackThreshold, unsigned char whiteThreshold, int jumpPeriod, int searchDistance, double boost, double curve, int mode, int frameNumber, int borderSamples, bool invert, Rng rng, int routing, int routeThreads, int refineMicroseconds, PathHistory* history, HilligossStats* stats) {
+    HilligossEngine<Rng> engine(HilligossParams{ targetCount, blackThreshold, whiteThreshold, jumpPeriod, searchDistance, boost, curve, mode, borderSamples, invert, routing, routeThreads, refineMicroseconds });
+    engine.processStream(image, sink, frameNumber, rng, history, stats);
+}
+
+// The engines hilligoss() can be used with
+template class HilligossEngine<Philox4x32>;
+template class HilligossEngine<Xoshiro256pp>;
+template class HilligossEngine<std::mt19937>;
+template void hilligoss(const std::vector<unsigned char>&, std::vector<int16_t>&, int, unsigned char, unsigned char, int, int, double, double, int, int, int, bool, Philox4x32, int, int, int, PathHistory*, HilligossStats*);
+template int hilligoss(std::span<const uint8_t>, int, std::span<int16_t>, int, unsigned char, unsigned char, int, int, double, double, int, int, int, bool, Philox4x32, int, int, int, PathHistory*, HilligossStats*);
+template void hilligoss(const std::vector<unsigned char>&, std::vector<int16_t>&, int, unsigned char, unsigned char, int, int, double, double, int, int, int, bool, Xoshiro256pp, int, int, int, PathHistory*, HilligossStats*);
+template int hilligoss(std::span<const uint8_t>, int, std::span<int16_t>, int, unsigned char, unsigned char, int, int, double, double, int, int, int, bool, Xoshiro256pp, int, int, int, PathHistory*, HilligossStats*);
+template void hilligoss(const std::vector<unsigned char>&, std::vector<int16_t>&, int, unsigned char, unsigned char, int, int, double, double, int, int, int, bool, std::mt19937, int, int, int, PathHistory*, HilligossStats*);
+template int hilligoss(std::span<const uint8_t>, int, std::span<int16_t>, int, unsigned char, unsigned char, int, int, double, double, int, int, int, bool, std::mt19937, int, int, int, PathHistory*, HilligossStats*);
+template void hilligossStream(const std::vector<unsigned char>&, const SampleSink&, int, unsigned char, unsigned char, int, int, double, double, int, int, int, bool, Philox4x32, int, int, int, PathHistory*, HilligossStats*);
+template void hilligossStream(const std::vector<unsigned char>&, const SampleSink&, int, unsigned char, unsigned char, int, int, double, double, int, int, int, bool, Xoshiro256pp, int, int, int, PathHistory*, HilligossStats*);
+template void hilligossStream(const std::vector<unsigned char>&, const SampleSink&, int, unsigned char, unsigned char, int, int, double, double, int, int, int, bool, std::mt19937, int, int, int, PathHistory*, HilligossStats*);
+template std::vector<int16_t> determinePath(std::vector<int>&, int, int, int, Philox4x32&, int, int, const PathHistory*, const SampleSink*);
+template std::vector<int16_t> determinePath(std::vector<int>&, int, int, int, Xoshiro256pp&, int, int, const PathHistory*, const SampleSink*);
+template std::vector<int16_t> determinePath(std::vector<int>&, int, int, int, std::mt19937&, int, int, const PathHistory*, const SampleSink*);
+template std::vector<int> choosePixels(const std::vector<unsigned char>&, int, unsigned char, unsigned char, double, double, int, Philox4x32&, int, bool);
+template std::vector<int> choosePixels(const std::vector<unsigned char>&, int, unsigned char, unsigned char, double, double, int, Xoshiro256pp&, int, bool);
+template std::vector<int> choosePixels(const std::vector<unsigned char>&, int, unsigned char, unsigned char, double, double, int, std::mt19937&, int, bool);
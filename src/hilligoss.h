@@ -34,8 +34,189 @@ THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR I
 #include <cstring>
 #include <chrono>
 #include <thread>
+#include <bit>
+#include <cmath>
+#include <climits>
+#include <functional>
+#include <optional>
+#include <memory>
+#include <span>
+#include <numeric>
+#include <atomic>
+#include <cstdlib>
 
-//#define TIMEIT
+// xoshiro256++ by Blackman and Vigna: a small, fast random number generator that works with the
+// <random> distributions. Much quicker than std::mt19937 to seed, copy and run, which matters since
+// every hilligoss() call gets a copy of its own. seed() spreads a single value over the whole state.
+class Xoshiro256pp {
+public:
+    typedef uint64_t result_type;
+
+    explicit Xoshiro256pp(uint64_t value = 1) { seed(value); }
+
+    void seed(uint64_t value) {
+        // splitmix64, so that similar seeds still give unrelated states
+        for (uint64_t& word : s) {
+            uint64_t z = (value += 0x9E3779B97F4A7C15ull);
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+            word = z ^ (z >> 31);
+        }
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT64_MAX; }
+
+    result_type operator()() {
+        uint64_t result = std::rotl(s[0] + s[3], 23) + s[0];
+        uint64_t t = s[1] << 17;
+        s[2] ^= s[0];
+        s[3] ^= s[1];
+        s[1] ^= s[2];
+        s[0] ^= s[3];
+        s[2] ^= t;
+        s[3] = std::rotl(s[3], 45);
+        return result;
+    }
+
+    void discard(unsigned long long count) {
+        while (count--) (*this)();
+    }
+
+private:
+    uint64_t s[4];
+};
+
+// Philox4x32-10 by Salmon et al.: a counter-based random number generator. Every number is a hash of
+// the key (the seed) and its position in the stream, which is itself keyed on a frame number and a
+// stage, so a frame's random numbers depend only on (seed, frame, stage) and not on which thread or
+// process got to it first, or on how many numbers anything else used. discard() is instant.
+class Philox4x32 {
+public:
+    typedef uint32_t result_type;
+
+    explicit Philox4x32(uint64_t seed = 1, uint32_t frame = 0, uint32_t stage = 0)
+        : key{ (uint32_t)seed, (uint32_t)(seed >> 32) }, frame(frame), stage(stage) {}
+
+    // Jump to the start of the stream for <newStage> of the same frame
+    void setStage(uint32_t newStage) {
+        stage = newStage;
+        index = 0;
+        used = 4;
+    }
+
+    static constexpr result_type min() { return 0; }
+    static constexpr result_type max() { return UINT32_MAX; }
+
+    result_type operator()() {
+        if (used == 4) refill();
+        return block[used++];
+    }
+
+    void discard(unsigned long long count) {
+        // Use up what's left of the current block, then skip whole blocks without generating them
+        while (count > 0 && used < 4) {
+            used++;
+            count--;
+        }
+        index += count / 4;
+        if (count % 4 != 0) {
+            refill();
+            used = (int)(count % 4);
+        }
+    }
+
+private:
+    // Generate the next block of four numbers
+    void refill() {
+        uint32_t c[4] = { (uint32_t)index, (uint32_t)(index >> 32), frame, stage };
+        uint32_t k[2] = { key[0], key[1] };
+        for (int round = 0; round < 10; round++) {
+            uint64_t p0 = (uint64_t)0xD2511F53u * c[0];
+            uint64_t p1 = (uint64_t)0xCD9E8D57u * c[2];
+            uint32_t next[4] = { (uint32_t)(p1 >> 32) ^ c[1] ^ k[0], (uint32_t)p1, (uint32_t)(p0 >> 32) ^ c[3] ^ k[1], (uint32_t)p0 };
+            std::memcpy(c, next, sizeof(c));
+            k[0] += 0x9E3779B9u;
+            k[1] += 0xBB67AE85u;
+        }
+        std::memcpy(block, c, sizeof(block));
+        index++;
+        used = 0;
+    }
+
+    uint32_t key[2];
+    uint32_t frame;
+    uint32_t stage;
+    uint64_t index = 0;
+    uint32_t block[4] = { 0 };
+    int used = 4;
+};
+
+// Information about a single call to hilligoss()
+struct HilligossStats {
+    // Total distance the beam travels between samples, in pixels, before and after refinePath
+    double jumpLengthBefore = 0;
+    double jumpLengthAfter = 0;
+
+    // How long each stage took, in nanoseconds. Preparing only counts towards the first draw after
+    // HilligossEngine::prepare(), and the total is all of them together.
+    long long prepareNanoseconds = 0;
+    long long chooseNanoseconds = 0;
+    long long routeNanoseconds = 0;
+    long long refineNanoseconds = 0;
+    long long totalNanoseconds = 0;
+
+    // How many pixels (or cells, when sampling from a coarser level) were above the black level and
+    // could be picked, and how many were looked at but left out for being at or below it
+    long candidates = 0;
+    long rejected = 0;
+
+    // Points asked for, and how many the image actually had to give before they were padded out with
+    // repeats
+    int targetCount = 0;
+    int points = 0;
+
+    // Strokes the routing drew (each one a lap of the greedy search, a run along the curve, or a run
+    // following the previous frame's path with a warm start), how many points they had on average, and
+    // how many nearest point searches it took
+    int strokes = 0;
+    double meanStrokeLength = 0;
+    long searches = 0;
+};
+
+// Receives samples as soon as they're ready: <samples> holds <count> points as alternating x and y values
+typedef std::function<void(const int16_t* samples, int count)> SampleSink;
+
+// The path from the previous frame, used to give the next frame a head start. Keep one of these
+// per sequence of frames and pass it to every hilligoss() call for that sequence.
+struct PathHistory {
+    // Alternating x and y samples, without the border
+    std::vector<int16_t> samples;
+};
+
+// Everything that controls how frames are converted, see hilligoss() for what each one does
+struct HilligossParams {
+    int targetCount = 3200;
+    unsigned char blackThreshold = 30;
+    unsigned char whiteThreshold = 230;
+    int jumpPeriod = 100;
+    int searchDistance = 255;
+    double boost = 30;
+    double curve = 1;
+    int mode = 0;
+    int borderSamples = 0;
+    bool invert = false;
+    int routing = 0;
+    int routeThreads = 1;
+    int refineMicroseconds = 0;
+    // Size of the images, which can be anything (the functions that take a vector always use PIX_CT x PIX_CT)
+    int width = PIX_CT;
+    int height = PIX_CT;
+    // How many threads to split choosing the pixels between (modes 0 and 3-6 only), each one taking a
+    // different band of the image. Each band gets its share of the points, so they're spread out more
+    // evenly too.
+    int sampleThreads = 1;
+};
 
 // Convert an 8-bit grayscale image into 16-bit stereo PCM
 //   image: the image to convert, flattened row-by-row
@@ -48,9 +229,123 @@ THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR I
 //   boost: how far to increase the pixel value at the black level
 //   curve: how aggressively to curve the input pixels
 //   mode: special modes (0 is default, 1 is stippling mode)
-void hilligoss(const std::vector<unsigned char> image, std::vector<int16_t>& destination, int targetCount,
+//   routing: how to order the pixels (0 is brute force search, 1 is bitboard grid search, 2 is space-filling curve)
+//   routeThreads: how many threads to split the routing between, each one taking a different part of the image
+//   refineMicroseconds: time to spend shortening the jumps in the path afterwards (0 to disable)
+//   history: if not null, the path is based on the one saved in here, and then this frame's path is saved into it
+//   stats: if not null, filled in with information about how the frame went
+// The random number engine can be Philox4x32, Xoshiro256pp or std::mt19937; each call only ever uses its
+// own copy, so calls on different threads don't share any state. With Philox4x32, choosing and routing
+// each get a stream of their own, so a frame comes out the same for the same seed and frame number.
+template <class Rng>
+void hilligoss(const std::vector<unsigned char>& image, std::vector<int16_t>& destination, int targetCount,
+    unsigned char blackThreshold, unsigned char whiteThreshold, int jumpPeriod, int searchDistance,
+    double boost, double curve, int mode, int frameNumber, int borderSamples, bool invert, Rng rng, int routing = 0,
+    int routeThreads = 1, int refineMicroseconds = 0, PathHistory* history = nullptr, HilligossStats* stats = nullptr);
+
+// Same as hilligoss(), but the image is read in place and the samples are written straight into <destination>
+// instead of being added onto a vector, so neither gets copied. Row y of the image starts at image[y * stride],
+// so a cropped part of a bigger image works too. Samples that don't fit in <destination> are dropped (it needs
+// room for targetCount + borderSamples points), and the number of points written is returned. Nothing is
+// written if the image is too small for its stride.
+template <class Rng>
+int hilligoss(std::span<const uint8_t> image, int stride, std::span<int16_t> destination, int targetCount,
+    unsigned char blackThreshold, unsigned char whiteThreshold, int jumpPeriod, int searchDistance,
+    double boost, double curve, int mode, int frameNumber, int borderSamples, bool invert, Rng rng, int routing = 0,
+    int routeThreads = 1, int refineMicroseconds = 0, PathHistory* history = nullptr, HilligossStats* stats = nullptr);
+
+// Same as hilligoss(), but the samples are passed to <sink> as they're generated instead of going into a
+// vector. Each stroke is passed on as soon as it's finished (unless refineMicroseconds is set, since that
+// rearranges the whole path first), followed by any padding and then the border.
+template <class Rng>
+void hilligossStream(const std::vector<unsigned char>& image, const SampleSink& sink, int targetCount,
     unsigned char blackThreshold, unsigned char whiteThreshold, int jumpPeriod, int searchDistance,
-    double boost, double curve, int mode, int frameNumber, int borderSamples, bool invert, std::mt19937 rng);
+    double boost, double curve, int mode, int frameNumber, int borderSamples, bool invert, Rng rng, int routing = 0,
+    int routeThreads = 1, int refineMicroseconds = 0, PathHistory* history = nullptr, HilligossStats* stats = nullptr);
+
+struct HilligossScratch;
+
+// Converts frame after frame with the same parameters, which is what hilligoss() does once per call.
+// The lookup table and the border only depend on the parameters so they're worked out once, and the
+// working buffers are kept from one frame to the next, so after the first frame or two nothing gets
+// allocated (except by sampleThreads, routeThreads, history and stats, which still need some memory every frame).
+// Not thread-safe: give each thread an engine of its own.
+template <class Rng>
+class HilligossEngine {
+public:
+    explicit HilligossEngine(const HilligossParams& params);
+    HilligossEngine(HilligossEngine&& other) noexcept;
+    HilligossEngine& operator=(HilligossEngine&& other) noexcept;
+    ~HilligossEngine();
+
+    // Convert <image>, adding the samples onto the end of <destination> (see hilligoss())
+    void process(const std::vector<unsigned char>& image, std::vector<int16_t>& destination, int frameNumber, Rng rng,
+        PathHistory* history = nullptr, HilligossStats* stats = nullptr);
+
+    // Convert <image> in place, writing the samples straight into <destination> (see the span version of
+    // hilligoss()). Returns how many points were written.
+    int process(std::span<const uint8_t> image, int stride, std::span<int16_t> destination, int frameNumber, Rng rng,
+        PathHistory* history = nullptr, HilligossStats* stats = nullptr);
+
+    // Convert <image>, passing the samples to <sink> as they're generated (see hilligossStream())
+    void processStream(const std::vector<unsigned char>& image, const SampleSink& sink, int frameNumber, Rng rng,
+        PathHistory* history = nullptr, HilligossStats* stats = nullptr);
+    void processStream(std::span<const uint8_t> image, int stride, const SampleSink& sink, int frameNumber, Rng rng,
+        PathHistory* history = nullptr, HilligossStats* stats = nullptr);
+
+    // Convert the same image into several frames (for -split and -frameloop) by calling prepare() on it
+    // once and then draw() or drawStream() for each frame. prepare() does the work that's the same for
+    // every frame of an image, like finding its lit pixels and bucketing them by value, so each draw only
+    // has to pick and route the points. The image has to stay where it is until the last draw, and each
+    // draw has to be given it again. A draw comes out exactly the same as process() would for that frame.
+    // A draw of an image that isn't the one last prepared (or when nothing has been) prepares it first, but
+    // an image changed in place since its prepare() needs preparing again.
+    void prepare(std::span<const uint8_t> image, int stride);
+    int draw(std::span<const uint8_t> image, int stride, std::span<int16_t> destination, int frameNumber, Rng rng,
+        PathHistory* history = nullptr, HilligossStats* stats = nullptr);
+    void drawStream(std::span<const uint8_t> image, int stride, const SampleSink& sink, int frameNumber, Rng rng,
+        PathHistory* history = nullptr, HilligossStats* stats = nullptr);
+
+    // How many points each frame comes out as, including the border
+    int pointsPerFrame() const;
+
+    const HilligossParams& parameters() const { return params; }
+
+private:
+    // Whether <image> holds all the rows of a width x height image <stride> bytes apart
+    bool fits(std::span<const uint8_t> image, int stride) const;
+
+    HilligossParams params;
+    double lookup[256];
+    std::vector<int16_t> border;
+    std::unique_ptr<HilligossScratch> scratch;
+};
+
+template <class Rng>
+std::vector<int16_t> determinePath(std::vector<int>& pixelsOriginal, int targetCount, int jumpPeriod, int searchDistance, Rng& rng, int routing = 0, int routeThreads = 1, const PathHistory* previous = nullptr, const SampleSink* sink = nullptr);
+template <class Rng>
+std::vector<int> choosePixels(const std::vector<unsigned char>& image, int targetCount, unsigned char black, unsigned char white, double boost, double curve, int mode, Rng& g, int frameNumber = 0, bool invert = false);
+
+// Shorten the first <pointCount> points of <path> with 2-opt and Or-opt moves until there's nothing left
+// to improve or <budgetMicroseconds> runs out, setting up included. Fills in the jump lengths in <stats>
+// if it isn't null (both 0 if the budget ran out before the path was even read in; a budget of 0 just
+// measures them). <width> and <height> are the size of the image the path was made from.
+void refinePath(std::vector<int16_t>& path, int pointCount, int budgetMicroseconds, HilligossStats* stats = nullptr, int width = PIX_CT, int height = PIX_CT);
+// Filters upsamplePath can interpolate with
+#define UPSAMPLE_LINEAR 0
+#define UPSAMPLE_CUBIC 1
+#define UPSAMPLE_SINC 2
+
+// Resample the XY samples in <samples>, made at <inputRate> points a second, up to <outputRate> (which
+// can't be lower) with a polyphase interpolation filter, one of the UPSAMPLE_ filters above. That lets
+// the path be routed with fewer points than the output has.
+std::vector<int16_t> upsamplePath(const std::vector<int16_t>& samples, int inputRate, int outputRate, int filter = UPSAMPLE_CUBIC);
 
-std::vector<int16_t> determinePath(std::vector<int>& pixelsOriginal, int targetCount, int jumpPeriod, int searchDistance, std::mt19937& rng );
-std::vector<int> choosePixels(const std::vector<unsigned char>& image, int targetCount, unsigned char black, unsigned char white, double boost, double curve, int mode, std::mt19937& g, int frameNumber = 0, bool invert = false);
\ No newline at end of file
+// The sampling and closest point search kernels are built for more than one instruction set: "baseline"
+// (whatever the compiler was targeting) everywhere, and "sse4.2", "avx2" and "avx512" as well on x86-64.
+// The best one the CPU can run gets used, unless the HILLIGOSS_SIMD environment variable names another.
+// They all give exactly the same results. simdVariant() is the name of the one in use.
+const char* simdVariant();
+// Use the kernels called <name> from now on. Returns false and changes nothing if there aren't any by
+// that name or the CPU can't run them.
+bool setSimdVariant(const std::string& name);
@@ -39,6 +39,7 @@ int main(int argc, char* argv[]) {
     double boost = 30;
     double curve = 1;
     int mode = 0;
+    int routing = 0;
 
     // Get the default target point count from sample rate and fps
     double sampleRate = 192000;
@@ -59,9 +60,9 @@ int main(int argc, char* argv[]) {
         // Help message
         if (s == "-h" || s == "--help") {
             std::cout << "Usage: hilligoss-nodeps -f <filename> -c <desired vectors per frame> -b <black threshold 0-255> -w <white threshold 1-255>" << std::endl;
-            std::cout << "                        -j <jump time 1-10000> [-t (enable tonal mode)]" << std::endl;
+            std::cout << "                        -j <jump time 1-10000> [-t (enable tonal mode)] [-r <routing mode 0-2>]" << std::endl;
             std::cout << "    Defaults: hilligoss-nodeps -f <your_input_here.pgm> -c 8000 -b 30 -w 230 -j 100" << std::endl;
-            std::cout << "    Notes : Images must be 8 - bit ASCII PGM, 512x512 only." << std::endl << std::endl;
+            std::cout << "    Notes : Images must be 8 - bit binary (P5) PGM, any size." << std::endl << std::endl;
             return 1;
         }
 
@@ -94,6 +95,11 @@ int main(int argc, char* argv[]) {
         else if (s == "-t") {
             syncCount = 2;
         }
+
+        // routing mode (0 is brute force, 1 is bitboard grid, 2 is space-filling curve)
+        else if (s == "-r") {
+            routing = std::min(2, std::max(0, (int)std::stod(*++i)));
+        }
     }
 
     // Divide target point count by the sync count, resultant samples will be repeated later to equal the original target
@@ -123,9 +129,9 @@ int main(int argc, char* argv[]) {
     // Get the size of the image
     ss >> numCols >> numRows;
 
-    // Make sure image size matches expected size
-    if (numCols != PIX_CT || numRows != PIX_CT) {
-        std::cerr << "Dimension mismatch: Expected " << PIX_CT << "x" << PIX_CT << ", got " << numRows << "x" << numCols << std::endl;
+    // Make sure there's an image to convert
+    if (numCols < 1 || numRows < 1) {
+        std::cerr << "Dimension error: got " << numCols << "x" << numRows << std::endl;
         return -2;
     }
 
@@ -134,7 +140,7 @@ int main(int argc, char* argv[]) {
 
     // Reserve the array of pixels
     std::vector<unsigned char> image;
-    image.reserve(PIX_CT * PIX_CT);
+    image.reserve(numCols * numRows);
 
     // Loop over the file
     for (int row = 0; row < numRows; ++row) {
@@ -152,11 +158,24 @@ int main(int argc, char* argv[]) {
 
     int t = (static_cast<long int> (time(NULL))) % 65536;
     std::random_device rd{};
-    std::mt19937 rng = std::mt19937{ rd() };
+    Xoshiro256pp rng = Xoshiro256pp{ rd() };
     rng.discard(t);
 
     // Run Hilligoss!
-    hilligoss(image, pcm, targetPointCount, black_level, white_level, jump_timer, searchDistance, boost, curve, mode, 0, 0, false, rng);
+    HilligossParams params;
+    params.targetCount = targetPointCount;
+    params.blackThreshold = black_level;
+    params.whiteThreshold = white_level;
+    params.jumpPeriod = jump_timer;
+    params.searchDistance = searchDistance;
+    params.boost = boost;
+    params.curve = curve;
+    params.mode = mode;
+    params.routing = routing;
+    params.width = numCols;
+    params.height = numRows;
+    HilligossEngine<Xoshiro256pp> engine(params);
+    engine.process(image, pcm, 0, rng);
 
     // Generate the output file name and open it
     std::string outputFileName = inputFileName.substr(0, inputFileName.size() - 4).append(".pcm");
@@ -29,6 +29,7 @@ THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR I
 #include <fstream>
 #include <iostream>
 #include <ctime>
+#include <cstdio>
 
 void show(const cv::Mat &img){
 	cv::imshow("input",img);
@@ -53,113 +54,113 @@ bool kbhit(int time)
     }
 }
 
-void resizeKeepAspectRatio(const cv::Mat& src, cv::Mat& dst, const cv::Size& dstSize, const cv::Scalar& backgroundColor)
-{
-    // Don't handle anything in this corner case
-    if (dstSize.width <= 0 || dstSize.height <= 0)
-        return;
-
-    // Not job is needed here, let's avoid any copy
-    if (src.cols == dstSize.width && src.rows == dstSize.height)
-    {
-        dst = src;
-        return;
-    }
+// The value <fraction> of the way up the sorted <values>
+double percentile(const std::vector<double>& values, double fraction) {
+    return values[std::min(values.size() - 1, (size_t)(fraction * values.size()))];
+}
 
-    // Try not to reallocate memory if possible
-    cv::Mat output = [&]()
-        {
-            if (dst.data != src.data && dst.cols == dstSize.width && dst.rows == dstSize.height && dst.type() == src.type())
-                return dst;
-            return cv::Mat(dstSize.height, dstSize.width, src.type());
-        }();
-
-    // 'src' inside 'dst'
-    const auto imageBox = [&]()
-        {
-            const auto h1 = int(dstSize.width * (src.rows / (double)src.cols));
-            const auto w2 = int(dstSize.height * (src.cols / (double)src.rows));
-
-            const bool horizontal = h1 <= dstSize.height;
-
-            const auto width = horizontal ? dstSize.width : w2;
-            const auto height = horizontal ? h1 : dstSize.height;
-
-            const auto x = horizontal ? 0 : int(double(dstSize.width - width) / 2.);
-            const auto y = horizontal ? int(double(dstSize.height - height) / 2.) : 0;
-
-            return cv::Rect(x, y, width, height);
-        }();
-
-    cv::Rect firstBox;
-    cv::Rect secondBox;
-
-    if (imageBox.width > imageBox.height)
-    {
-        // ┌──────────────►  x
-        // │ ┌────────────┐
-        // │ │┼┼┼┼┼┼┼┼┼┼┼┼│ firstBox
-        // │ x────────────►
-        // │ │            │
-        // │ ▼────────────┤
-        // │ │┼┼┼┼┼┼┼┼┼┼┼┼│ secondBox
-        // │ └────────────┘
-        // ▼
-        // y
-
-        firstBox.x = 0;
-        firstBox.width = dstSize.width;
-        firstBox.y = 0;
-        firstBox.height = imageBox.y;
-
-        secondBox.x = 0;
-        secondBox.width = dstSize.width;
-        secondBox.y = imageBox.y + imageBox.height;
-        secondBox.height = dstSize.height - secondBox.y;
-    }
-    else
-    {
-        // ┌──────────────►  x
-        // │ ┌──x──────►──┐
-        // │ │┼┼│      │┼┼│
-        // │ │┼┼│      │┼┼│
-        // │ │┼┼│      │┼┼│
-        // │ └──▼──────┴──┘
-        // ▼  firstBox  secondBox
-        // y
-
-        firstBox.y = 0;
-        firstBox.height = dstSize.height;
-        firstBox.x = 0;
-        firstBox.width = imageBox.x;
-
-        secondBox.y = 0;
-        secondBox.height = dstSize.height;
-        secondBox.x = imageBox.x + imageBox.width;
-        secondBox.width = dstSize.width - secondBox.x;
+// Print the median, 99th percentile and maximum of <get> over every frame in <frames>
+template <class F>
+void printSpread(const std::vector<HilligossStats>& frames, const char* name, const char* unit, F get) {
+    std::vector<double> values;
+    for (const HilligossStats& s : frames) values.push_back(get(s));
+    std::sort(values.begin(), values.end());
+    printf("  %-20s p50 %10.3f   p99 %10.3f   max %10.3f %s\n", name, percentile(values, 0.5), percentile(values, 0.99), values.back(), unit);
+}
+
+// Print how every frame went, stage by stage, so the slow ones stand out
+void printStats(const std::vector<HilligossStats>& frames) {
+    if (frames.empty()) return;
+    printf("Hilligoss 2.0 - Per-frame stats over %zu frames:\n", frames.size());
+    printSpread(frames, "prepare", "ms", [](const HilligossStats& s) { return s.prepareNanoseconds * 1e-6; });
+    printSpread(frames, "choose pixels", "ms", [](const HilligossStats& s) { return s.chooseNanoseconds * 1e-6; });
+    printSpread(frames, "route", "ms", [](const HilligossStats& s) { return s.routeNanoseconds * 1e-6; });
+    printSpread(frames, "refine", "ms", [](const HilligossStats& s) { return s.refineNanoseconds * 1e-6; });
+    printSpread(frames, "total", "ms", [](const HilligossStats& s) { return s.totalNanoseconds * 1e-6; });
+    printSpread(frames, "candidates", "", [](const HilligossStats& s) { return (double)s.candidates; });
+    printSpread(frames, "rejected", "", [](const HilligossStats& s) { return (double)s.rejected; });
+    printSpread(frames, "points short", "", [](const HilligossStats& s) { return (double)(s.targetCount - s.points); });
+    printSpread(frames, "strokes", "", [](const HilligossStats& s) { return (double)s.strokes; });
+    printSpread(frames, "mean stroke length", "points", [](const HilligossStats& s) { return s.meanStrokeLength; });
+    printSpread(frames, "searches", "", [](const HilligossStats& s) { return (double)s.searches; });
+}
+
+// Write how every frame went to <filename>, one line per frame
+bool writeStats(const std::vector<HilligossStats>& frames, const std::string& filename) {
+    std::ofstream out(filename);
+    if (!out) return false;
+    out << "frame,prepare_ns,choose_ns,route_ns,refine_ns,total_ns,candidates,rejected,target_points,points,strokes,mean_stroke_length,searches,jump_length_before,jump_length_after\n";
+    for (size_t f = 0; f < frames.size(); f++) {
+        const HilligossStats& s = frames[f];
+        out << f << ',' << s.prepareNanoseconds << ',' << s.chooseNanoseconds << ',' << s.routeNanoseconds << ',' << s.refineNanoseconds << ',' << s.totalNanoseconds << ','
+            << s.candidates << ',' << s.rejected << ',' << s.targetCount << ',' << s.points << ',' << s.strokes << ',' << s.meanStrokeLength << ',' << s.searches << ','
+            << s.jumpLengthBefore << ',' << s.jumpLengthAfter << '\n';
     }
+    return true;
+}
 
-    // Resizing to final image avoid useless memory allocation
-    cv::Mat outputImage = output(imageBox);
-    assert(outputImage.cols == imageBox.width);
-    assert(outputImage.rows == imageBox.height);
-    const auto* dataBeforeResize = outputImage.data;
-    cv::resize(src, outputImage, cv::Size(outputImage.cols, outputImage.rows));
-    assert(dataBeforeResize == outputImage.data);
-
-    const auto drawBox = [&](const cv::Rect& box)
-        {
-            if (box.width > 0 && box.height > 0)
-            {
-                cv::rectangle(output, cv::Point(box.x, box.y), cv::Point(box.x + box.width, box.y + box.height), backgroundColor, -1);
-            }
-        };
+typedef std::chrono::steady_clock::time_point TimePoint;
+
+// One span of work on the -trace timeline
+struct TraceEvent {
+    const char* name;
+    TimePoint start, end;
+    // The frame it was for, or -1 if it wasn't for just one
+    int frame;
+};
+
+// The spans one thread recorded for -trace. Each thread only ever adds to its own, so nothing needs
+// locking, and they're all written out together at the end once the threads are done.
+struct TraceBuffer {
+    std::string threadName;
+    std::vector<TraceEvent> events;
+};
+
+// The time now if <buffer> is there, so tracing costs no more than a branch when it's off
+TimePoint traceClock(const TraceBuffer* buffer) {
+    return buffer != nullptr ? std::chrono::steady_clock::now() : TimePoint();
+}
 
-    drawBox(firstBox);
-    drawBox(secondBox);
+// Record a span of <name> from <start> until now in <buffer>, if it's there
+void traceSpan(TraceBuffer* buffer, const char* name, TimePoint start, int frame = -1) {
+    if (buffer != nullptr) buffer->events.push_back({ name, start, std::chrono::steady_clock::now(), frame });
+}
 
-    // Finally copy output to dst, like that user can use src & dst to the same cv::Mat
-    dst = output;
+// Record the stages of a hilligoss() call that started at <start> in <buffer>, laid end to end using the
+// times in <stats>
+void traceStages(TraceBuffer* buffer, TimePoint start, const HilligossStats& stats, int frame) {
+    if (buffer == nullptr) return;
+    const char* names[3] = { "choose pixels", "route", "refine" };
+    long long durations[3] = { stats.chooseNanoseconds, stats.routeNanoseconds, stats.refineNanoseconds };
+    for (int i = 0; i < 3; i++) {
+        TimePoint end = start + std::chrono::nanoseconds(durations[i]);
+        buffer->events.push_back({ names[i], start, end, frame });
+        start = end;
+    }
+}
+
+// Write every span in <buffers> to <filename> as Chrome trace event JSON (which Perfetto and
+// chrome://tracing can open), with one track per thread and times counted from <origin>
+bool writeTrace(const std::vector<TraceBuffer>& buffers, TimePoint origin, const std::string& filename) {
+    std::ofstream out(filename);
+    if (!out) return false;
+    auto micros = [&](TimePoint t) {
+        return std::chrono::duration<double, std::micro>(t - origin).count();
+    };
+    char line[512];
+    out << "{\"traceEvents\":[\n";
+    bool first = true;
+    for (size_t tid = 0; tid < buffers.size(); tid++) {
+        snprintf(line, sizeof(line), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", tid, buffers[tid].threadName.c_str());
+        out << line;
+        first = false;
+        for (const TraceEvent& e : buffers[tid].events) {
+            snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%zu,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"frame\":%d}}", e.name, tid, micros(e.start), micros(e.end) - micros(e.start), e.frame);
+            out << line;
+        }
+    }
+    out << "\n]}\n";
+    return true;
 }
 
 int main(int argc, char*argv[]) {
@@ -167,6 +168,8 @@ int main(int argc, char*argv[]) {
 	std::vector<std::string> args(argv + 1, argv + argc);
     std::string infname = "input.mp4";
     double sampleRate = 192000;
+    double pointRate = 0;
+    int upsampleFilter = UPSAMPLE_CUBIC;
     int BATCH_SIZE = 1;
     int black_level = 30;
     int white_level = 230;
@@ -182,6 +185,17 @@ int main(int argc, char*argv[]) {
 	double border = 0;
     int mode = 0;
     bool invert = false;
+    int routing = 0;
+    int routeThreads = 1;
+    int sampleThreads = 1;
+    int refineBudget = 0;
+    int size = PIX_CT;
+    bool warmStart = false;
+    uint64_t seed = 0;
+    bool seeded = false;
+    bool printFrameStats = false;
+    std::string statsFilename;
+    std::string traceFilename;
     bool alert = false;
 
     std::time_t timestamp = time(NULL);
@@ -207,7 +221,12 @@ int main(int argc, char*argv[]) {
                 "\n          -white <white level (0-255)>" <<
                 "\n          -jump <jump spacing (>= 1)>" <<
                 "\n          -rate <sample rate (>= 1)>" <<
-                "\n          -threads <thread count (>= 1)>" << 
+                "\n          -pointrate <points per second to route, upsampled to the sample rate afterwards (default is the sample rate)>" <<
+                "\n          -upsample <filter to upsample with>" <<
+                "\n              0: linear" <<
+                "\n              1: cubic (default)" <<
+                "\n              2: windowed sinc" <<
+                "\n          -threads <thread count (>= 1), each taking a whole video frame with its -split and -frameloop repeats>" << 
                 "\n          -framerate <framerate/frequency (>= 0.1)>" <<
                 "\n          -distance <search radius (<= 0 to disable)>" <<
                 "\n          -preview (enable preview)" <<
@@ -221,7 +240,24 @@ int main(int argc, char*argv[]) {
                 "\n              0: normal" <<
                 "\n              1: sparkly" <<
                 "\n              2: extra sparkly" <<
-                "\n              3-6: scrolling grid" << std::endl;
+                "\n              3-6: scrolling grid" <<
+                "\n          -routing <path routing mode>" <<
+                "\n              0: brute force search" <<
+                "\n              1: bitboard grid search (faster for large point counts)" <<
+                "\n              2: space-filling curve (fastest, slightly longer jumps)" <<
+                "\n          -routethreads <threads to split each frame's routing between (>= 1)>" <<
+                "\n          -samplethreads <threads to split each frame's pixel choosing between (>= 1)>" <<
+                "\n          -refine <microseconds per frame to spend shortening jumps (0 to disable)>" <<
+                "\n          -warmstart (base each frame's path on the last one its thread drew, which is the previous" <<
+                "\n              frame with -threads 1 but -threads video frames back otherwise)" <<
+                "\n          -seed <random seed (the same seed always gives the same output)>" <<
+                "\n          -size <longest side of the image to work from in pixels (>= 16), default is 512>" <<
+                "\n          -stats (print how long each stage took per frame, and more, at the end)" <<
+                "\n          -statscsv <filename to write the per-frame stats to as CSV>" <<
+                "\n          -trace <filename to write a timeline of every thread's work to, for Perfetto or chrome://tracing>" <<
+                "\n          -simd <instruction set for the sampling and search kernels, picked from the CPU by default>" <<
+                "\n              baseline: whatever this was compiled for" <<
+                "\n              sse4.2, avx2, avx512: x86-64 only" << std::endl;
 
             return 0;
         }
@@ -243,6 +279,12 @@ int main(int argc, char*argv[]) {
         else if (*i == "-r" || *i == "-rate") {
             sampleRate = std::max(1.0, stod(*++i));
         }
+        else if (*i == "-pointrate") {
+            pointRate = std::max(1.0, stod(*++i));
+        }
+        else if (*i == "-upsample") {
+            upsampleFilter = std::min(2, std::max(0, stoi(*++i)));
+        }
         else if (*i == "-t" || *i == "-threads") {
             BATCH_SIZE = std::max(1, stoi(*++i));
         }
@@ -279,6 +321,44 @@ int main(int argc, char*argv[]) {
         else if (*i == "-invert") {
             invert = true;
         }
+        else if (*i == "-routing") {
+            routing = std::min(2, std::max(0, stoi(*++i)));
+        }
+        else if (*i == "-routethreads") {
+            routeThreads = std::max(1, stoi(*++i));
+        }
+        else if (*i == "-samplethreads") {
+            sampleThreads = std::max(1, stoi(*++i));
+        }
+        else if (*i == "-refine") {
+            refineBudget = std::max(0, stoi(*++i));
+        }
+        else if (*i == "-warmstart") {
+            warmStart = true;
+        }
+        else if (*i == "-seed") {
+            seed = stoull(*++i);
+            seeded = true;
+        }
+        else if (*i == "-size") {
+            size = std::max(16, stoi(*++i));
+        }
+        else if (*i == "-stats") {
+            printFrameStats = true;
+        }
+        else if (*i == "-statscsv") {
+            statsFilename = *++i;
+        }
+        else if (*i == "-trace") {
+            traceFilename = *++i;
+        }
+        else if (*i == "-simd") {
+            std::string variant = *++i;
+            if (!setSimdVariant(variant)) {
+                std::cout << "Hilligoss 2.0 - Unknown instruction set " << variant << ", or this CPU doesn't have it!\n" << std::endl;
+                return -1;
+            }
+        }
     }
 
     if (alert) std::this_thread::sleep_for(std::chrono::milliseconds(1000));
@@ -290,7 +370,10 @@ int main(int argc, char*argv[]) {
     noecho();
     flushinp();
 
-    printw("Hilligoss 2.0\n");
+    printw("Hilligoss 2.0 (%s kernels)\n", simdVariant());
+    if (warmStart && BATCH_SIZE > 1) {
+        printw("Warning: with -threads %d, -warmstart bases each video frame on the one %d frames back, not the previous one.\n", BATCH_SIZE, BATCH_SIZE);
+    }
 
     cv::String inFile(infname);
 
@@ -305,35 +388,87 @@ int main(int argc, char*argv[]) {
         printw("Press enter to save to disk and quit, or shift+q to quit without saving.\n");
     }
 
-    cv::Mat inFrame, procFrame;
-    std::vector<unsigned char> frame(PIX_CT * PIX_CT);
+    cv::Mat inFrame, procFrame, current;
     std::vector<int16_t> pcm;
 
     if (fps == -1) fps = capture.get(cv::CAP_PROP_FPS);
     double nFrames = capture.get(cv::CAP_PROP_FRAME_COUNT);
     double delta = 1000.0 / fps;
-    int targetPointCount = (int)(sampleRate / fps / split);
+    // Route at the point rate, which is never more than the sample rate
+    pointRate = pointRate > 0 ? std::min(pointRate, sampleRate) : sampleRate;
+    int targetPointCount = (int)(pointRate / fps / split);
 	int borderPointCount = (int)(targetPointCount * border);
 	targetPointCount -= borderPointCount;
 	
 	int realLoop = frameLoop * split;
 
-    srand((unsigned)time(NULL));
+    // Work from an image with the video's shape, with <size> pixels along its longer side
+    double videoWidth = capture.get(cv::CAP_PROP_FRAME_WIDTH);
+    double videoHeight = capture.get(cv::CAP_PROP_FRAME_HEIGHT);
+    int width = size, height = size;
+    if (videoWidth > 0 && videoHeight > 0) {
+        if (videoWidth >= videoHeight) height = std::max(1, (int)std::lround(size * videoHeight / videoWidth));
+        else width = std::max(1, (int)std::lround(size * videoWidth / videoHeight));
+    }
 
     std::vector<std::thread> threads;
-    std::vector<std::vector<int16_t>> results(BATCH_SIZE);
+    // Each thread slot takes a whole video frame at a time, along with all its repeats for -split and
+    // -frameloop, so the frame only has to be prepared once
+    std::vector<HilligossStats> stats(BATCH_SIZE * realLoop);
+
+    // One engine per thread slot, so each keeps its buffers from one batch to the next
+    HilligossParams params;
+    params.targetCount = targetPointCount;
+    params.blackThreshold = black_level;
+    params.whiteThreshold = white_level;
+    params.jumpPeriod = jump_timer;
+    params.searchDistance = searchDistance;
+    params.boost = boost;
+    params.curve = curve;
+    params.mode = mode;
+    params.borderSamples = borderPointCount;
+    params.invert = invert;
+    params.routing = routing;
+    params.routeThreads = routeThreads;
+    params.sampleThreads = sampleThreads;
+    params.refineMicroseconds = refineBudget;
+    params.width = width;
+    params.height = height;
+    std::vector<HilligossEngine<Philox4x32>> engines;
+    for (int t = 0; t < BATCH_SIZE; t++) {
+        engines.emplace_back(params);
+    }
 
-    bool done = false;
+    // Frames get written straight into the output, so make room for all of them up front
+    int frameSamples = engines[0].pointsPerFrame() * 2;
+    if (nFrames > 0) pcm.reserve((size_t)(nFrames * realLoop) * syncCount * frameSamples);
+
+    // Each thread slot follows on from the frame it rendered in the previous batch
+    std::vector<PathHistory> histories(BATCH_SIZE);
+    double jumpLengthBefore = 0;
+    double jumpLengthAfter = 0;
+    // Every frame's stats, in order, if they're wanted at the end
+    bool collectStats = printFrameStats || !statsFilename.empty();
+    std::vector<HilligossStats> frameStats;
+
+    // A timeline for the main thread and each thread slot, if one's wanted
+    bool tracing = !traceFilename.empty();
+    std::vector<TraceBuffer> traces(tracing ? BATCH_SIZE + 1 : 0);
+    for (size_t b = 0; b < traces.size(); b++) {
+        traces[b].threadName = b == 0 ? "main" : "frame slot " + std::to_string(b - 1);
+        traces[b].events.reserve(1024);
+    }
+    TraceBuffer* mainTrace = tracing ? &traces[0] : nullptr;
 
-#ifdef TIMEIT
-    BATCH_SIZE = 1;
-#endif
+    bool done = false;
 
-    std::random_device rd{};
-    std::mt19937 rng = std::mt19937{rd()};
+    // Every frame gets its own random numbers, keyed on the seed and the frame number
+    if (!seeded) {
+        std::random_device rd{};
+        seed = ((uint64_t)rd() << 32) | rd();
+    }
 
 	int frameNumber = 0;
-    int counter = 0;
     while (done == false) {
         if (BATCH_SIZE < 1) {
             BATCH_SIZE = 1;
@@ -341,38 +476,60 @@ int main(int argc, char*argv[]) {
         int f = (frameNumber / realLoop);
         double progress = 100.0 * f / nFrames;
         if (BATCH_SIZE == 1) printw("\r%2.1f%c processed - Running frame %d", progress, '%', f);
-        else printw("\r%2.1f%c processed - Running frames %d through %d", progress, '%', f, (frameNumber + BATCH_SIZE)/ realLoop );
+        else printw("\r%2.1f%c processed - Running frames %d through %d", progress, '%', f, f + BATCH_SIZE - 1);
+        // Each frame in the batch goes into its own part of the end of the output, with a video frame's
+        // repeats one after the other
+        size_t batchStart = pcm.size();
+        pcm.resize(batchStart + (size_t)BATCH_SIZE * realLoop * syncCount * frameSamples);
         for (int t = 0; t < BATCH_SIZE; t++) {
-            results[t].clear();
-            results[t].reserve(targetPointCount * 2);
-            if (counter == 0) {
-                capture >> inFrame;
-
-                if (inFrame.empty()) {
-                    done = true;
-                    BATCH_SIZE = t;
-                    break;
-                }
+            TimePoint traceStart = traceClock(mainTrace);
+            capture >> inFrame;
+            traceSpan(mainTrace, "decode", traceStart, frameNumber);
 
-                cv::cvtColor(inFrame, inFrame, cv::COLOR_BGR2GRAY);
-                inFrame.convertTo(procFrame, CV_8UC1);
-                resizeKeepAspectRatio(procFrame, inFrame, cv::Size(PIX_CT, PIX_CT), {});
+            if (inFrame.empty()) {
+                done = true;
+                BATCH_SIZE = t;
+                break;
             }
-            counter = (counter + 1) % realLoop;
 
+            traceStart = traceClock(mainTrace);
+            cv::cvtColor(inFrame, inFrame, cv::COLOR_BGR2GRAY);
+            inFrame.convertTo(procFrame, CV_8UC1);
+            // Always a new Mat, so the frames the threads are still reading never get written over
+            current = cv::Mat();
+            cv::resize(procFrame, current, cv::Size(width, height));
+            traceSpan(mainTrace, "convert and resize", traceStart, frameNumber);
 
-            // frame is now PIX_CTxPIX_CT, 8-bit grayscale
+            // current is now width x height, 8-bit grayscale
             if (t == 0 && showPreview) {
-				show(inFrame);
+				show(current);
 			}
 
-            frame = (inFrame.isContinuous() ? inFrame : inFrame.clone()).reshape(1, 1); // data copy here
-            //frame = std::vector<uchar>(inFrame.begin<uchar>(), inFrame.end<uchar>());
-
-            rng.discard(100);
-            threads.push_back(std::thread(hilligoss, frame, std::ref(results[t]), targetPointCount, black_level, white_level, jump_timer, searchDistance, boost, curve, mode, frameNumber, borderPointCount, invert, rng));
+            // The thread shares the frame's pixels instead of copying them, prepares them once and then
+            // draws each of the frame's repeats from them
+            cv::Mat image = current;
+            TimePoint spawnStart = traceClock(mainTrace);
+            threads.push_back(std::thread([&, t, image, frameNumber]() {
+                TraceBuffer* trace = tracing ? &traces[t + 1] : nullptr;
+                TimePoint frameStart = traceClock(trace);
+                std::span<const uint8_t> pixels(image.data, image.step[0] * (image.rows - 1) + image.cols);
+                engines[t].prepare(pixels, (int)image.step[0]);
+                traceSpan(trace, "prepare", frameStart, frameNumber);
+                for (int r = 0; r < realLoop; r++) {
+                    int slot = t * realLoop + r;
+                    int repeatNumber = frameNumber + r;
+                    if (r > 0) frameStart = traceClock(trace);
+                    std::span<int16_t> destination(pcm.data() + batchStart + (size_t)slot * syncCount * frameSamples, frameSamples);
+                    TimePoint drawStart = traceClock(trace);
+                    engines[t].draw(pixels, (int)image.step[0], destination, repeatNumber, Philox4x32{ seed, (uint32_t)repeatNumber }, warmStart ? &histories[t] : nullptr, refineBudget > 0 || collectStats || tracing ? &stats[slot] : nullptr);
+                    traceStages(trace, drawStart, stats[slot], repeatNumber);
+                    traceSpan(trace, "draw", drawStart, repeatNumber);
+                    traceSpan(trace, "frame", frameStart, repeatNumber);
+                }
+            }));
+            traceSpan(mainTrace, "start thread", spawnStart, frameNumber);
 
-			frameNumber++;
+			frameNumber += realLoop;
         }
         refresh();
         if (kbhit(0)) {
@@ -389,17 +546,46 @@ int main(int argc, char*argv[]) {
                 return 0;
             }
         }
+        // Wait for the slowest frame in the batch
+        TimePoint traceStart = traceClock(mainTrace);
         for (std::thread& t : threads) {
             t.join();
         }
-        for (int t = 0; t < BATCH_SIZE; t++) {
-            for (int s = 0; s < syncCount; s++) {
-                pcm.insert(pcm.end(), results[t].begin(), results[t].end());
+        traceSpan(mainTrace, "wait for batch", traceStart);
+        // Drop the space for any frames the video ran out before, then repeat each frame for sync mode
+        int batchFrames = BATCH_SIZE * realLoop;
+        pcm.resize(batchStart + (size_t)batchFrames * syncCount * frameSamples);
+        for (int t = 0; t < batchFrames; t++) {
+            int16_t* first = pcm.data() + batchStart + (size_t)t * syncCount * frameSamples;
+            for (int s = 1; s < syncCount; s++) {
+                std::copy(first, first + frameSamples, first + s * frameSamples);
             }
         }
+        if (refineBudget > 0 && batchFrames > 0) {
+            // Report how much the refinement pass shortened the jumps in this batch
+            double before = 0, after = 0;
+            for (int t = 0; t < batchFrames; t++) {
+                before += stats[t].jumpLengthBefore;
+                after += stats[t].jumpLengthAfter;
+            }
+            jumpLengthBefore += before;
+            jumpLengthAfter += after;
+            printw(" - jumps %.0f -> %.0f px per frame   ", before / batchFrames, after / batchFrames);
+        }
+        if (collectStats) {
+            frameStats.insert(frameStats.end(), stats.begin(), stats.begin() + batchFrames);
+        }
         threads.clear();
     }
 
+    // Fill in the samples between the points
+    if (pointRate < sampleRate) {
+        TimePoint traceStart = traceClock(mainTrace);
+        pcm = upsamplePath(pcm, (int)std::lround(pointRate), (int)std::lround(sampleRate), upsampleFilter);
+        traceSpan(mainTrace, "upsample", traceStart);
+    }
+
+    TimePoint saveStart = traceClock(mainTrace);
     AudioFile<int16_t> outFile;
     outFile.setNumChannels(2);
     outFile.setSampleRate(sampleRate);
@@ -412,8 +598,21 @@ int main(int argc, char*argv[]) {
     }
 
     outFile.save(outfname, AudioFileFormat::Wave);
+    traceSpan(mainTrace, "save", saveStart);
 
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - now).count() * 0.001;
     endwin();
     std::cout << "Hilligoss 2.0 - Execution took " << duration << " seconds to process " << int(frameNumber / realLoop) << " frames. That's " << frameNumber / realLoop / duration << " frames per second, or a speed factor of " << frameNumber / realLoop / duration / fps << " (where >=1 is realtime)." << std::endl;
+    if (refineBudget > 0 && frameNumber > 0) {
+        std::cout << "Hilligoss 2.0 - Refinement shortened the jumps from " << jumpLengthBefore / frameNumber << " to " << jumpLengthAfter / frameNumber << " pixels per frame on average." << std::endl;
+    }
+    if (printFrameStats) {
+        printStats(frameStats);
+    }
+    if (tracing && !writeTrace(traces, now, traceFilename)) {
+        std::cout << "Hilligoss 2.0 - Unable to write the trace to " << traceFilename << "!" << std::endl;
+    }
+    if (!statsFilename.empty() && !writeStats(frameStats, statsFilename)) {
+        std::cout << "Hilligoss 2.0 - Unable to write the stats to " << statsFilename << "!" << std::endl;
+    }
 }
@@ -0,0 +1,344 @@
+/*
+Copyright 2025 BUS ERROR Collective
+
+Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the “Software”), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED “AS IS”, WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+*/
+// Checks for the properties that can break without anything looking wrong. Run with the name of a
+// test to run just that one, or with nothing to run them all. Exits with 1 if any of them fail.
+#include "hilligoss.h"
+
+// A test pattern that moves from frame to frame: a ring that grows and a gradient that slides across,
+// over a black background so the dark parts get skipped too
+static std::vector<uint8_t> makeFrame(int width, int height, int frame) {
+    std::vector<uint8_t> image(width * height, 0);
+    double radius = 20 + (frame * 7) % (std::min(width, height) / 2);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            double dx = x - width / 2, dy = y - height / 2;
+            double r = std::sqrt(dx * dx + dy * dy);
+            int v = 0;
+            if (std::fabs(r - radius) < 4) v = 255;
+            else if (y > height / 3) v = ((x + frame * 5) % width) * 255 / width;
+            image[y * width + x] = (uint8_t)v;
+        }
+    }
+    return image;
+}
+
+// Render frames <first> to <first> + <count> - 1 the way main-opencv does: <batchSize> frames at a
+// time, each one on its own thread with the engine for its slot, written into its own part of the output
+static std::vector<int16_t> renderFrames(const HilligossParams& params, uint64_t seed, int first, int count, int batchSize) {
+    std::vector<HilligossEngine<Philox4x32>> engines;
+    for (int t = 0; t < batchSize; t++) engines.emplace_back(params);
+    int frameSamples = engines[0].pointsPerFrame() * 2;
+
+    std::vector<int16_t> pcm((size_t)count * frameSamples);
+    for (int batch = 0; batch < count; batch += batchSize) {
+        std::vector<std::vector<uint8_t>> images;
+        for (int t = 0; t < batchSize && batch + t < count; t++) images.push_back(makeFrame(params.width, params.height, first + batch + t));
+
+        std::vector<std::thread> threads;
+        for (int t = 0; t < (int)images.size(); t++) {
+            threads.push_back(std::thread([&, t]() {
+                int frameNumber = first + batch + t;
+                std::span<int16_t> destination(pcm.data() + (size_t)(batch + t) * frameSamples, frameSamples);
+                engines[t].process(images[t], params.width, destination, frameNumber, Philox4x32{ seed, (uint32_t)frameNumber });
+            }));
+        }
+        for (std::thread& thread : threads) thread.join();
+    }
+    return pcm;
+}
+
+// Whether <a> and <b> hold the same samples, saying where they first differ if they don't
+static bool sameSamples(const std::vector<int16_t>& a, const std::vector<int16_t>& b, const std::string& what) {
+    if (a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(int16_t)) == 0) return true;
+    size_t i = 0;
+    while (i < std::min(a.size(), b.size()) && a[i] == b[i]) i++;
+    std::cout << "  " << what << ": differ from sample " << i << " (" << a.size() << " vs " << b.size() << " samples)" << std::endl;
+    return false;
+}
+
+// A frame comes out the same however many frames are rendered at once and whichever run renders it,
+// so renders can be split across threads or machines (-threads, -seed). -refine and -warmstart are left
+// out, since they depend on the clock and on the previous frame in the same slot.
+static bool testDeterminism() {
+    const int frames = 64;
+    const uint64_t seed = 12345;
+    bool passed = true;
+
+    for (int config = 0; config < 4; config++) {
+        HilligossParams params;
+        params.width = 256;
+        params.height = 192;
+        params.targetCount = 1600;
+        params.borderSamples = 100;
+        params.mode = config == 1 ? 1 : config == 2 ? 4 : 0;
+        params.routing = config % 3;
+        params.routeThreads = config == 3 ? 3 : 1;
+        params.sampleThreads = config == 3 ? 4 : 1;
+        std::string what = "mode " + std::to_string(params.mode) + ", routing " + std::to_string(params.routing) +
+            ", " + std::to_string(params.routeThreads) + " route threads, " + std::to_string(params.sampleThreads) + " sample threads";
+
+        std::vector<int16_t> single = renderFrames(params, seed, 0, frames, 1);
+        std::vector<int16_t> batched = renderFrames(params, seed, 0, frames, 32);
+        passed &= sameSamples(single, batched, what + ", 1 vs 32 threads");
+
+        // The second half on its own, as if another process had been given it
+        int frameSamples = (int)(single.size() / frames);
+        std::vector<int16_t> secondHalf(single.begin() + (size_t)(frames / 2) * frameSamples, single.end());
+        passed &= sameSamples(secondHalf, renderFrames(params, seed, frames / 2, frames / 2, 7), what + ", second half rendered separately");
+
+        // And a different seed shouldn't come out the same
+        if (renderFrames(params, seed + 1, 0, frames, 32) == single) {
+            std::cout << "  " << what << ": seed " << seed + 1 << " gave the same output as seed " << seed << std::endl;
+            passed = false;
+        }
+    }
+    return passed;
+}
+
+// The rejection sampler choosePixels used before the histogram sampler replaced it, as it was for mode 0
+// but with <g> in place of rand(). It walks a shuffled list of every pixel, taking each one whose curved
+// value beats a random number and getting greedier every time it goes round, until it has <targetCount>.
+static std::vector<int> rejectionSample(const std::vector<uint8_t>& image, int targetCount, unsigned char black, unsigned char white, double boost, double curve, std::mt19937& g) {
+    double lookup[256];
+    for (int i = 0; i < 256; i++) {
+        double z = std::max(0.0, i - (double)black) / std::max(0.00001, double(white - black));
+        z = pow(z, pow(2, curve));
+        z = boost + (255 - boost) * z;
+        lookup[i] = std::min(512.0, z);
+    }
+
+    std::vector<int> candidates(PIX_CT * PIX_CT);
+    for (int i = 0; i < PIX_CT * PIX_CT; i++) candidates[i] = i;
+    std::shuffle(candidates.begin(), candidates.end(), g);
+
+    std::vector<int> pixels;
+    double greed = 0.8;
+    int index = 0;
+    while ((int)pixels.size() < targetCount * 2) {
+        double z = std::uniform_int_distribution<int>(0, 100 * white - 1)(g) * 0.01;
+        unsigned char pixelValue = image[candidates[index]];
+        if (pixelValue <= black || lookup[pixelValue] * greed > z) {
+            if (pixelValue > black) {
+                pixels.push_back(candidates[index] % PIX_CT);
+                pixels.push_back(candidates[index] / PIX_CT);
+            }
+            candidates[index] = candidates.back();
+            candidates.pop_back();
+            index--;
+        }
+        if (candidates.empty()) break;
+        index += std::uniform_int_distribution<int>(0, 31)(g);
+        if (index >= (int)candidates.size()) {
+            index %= (int)candidates.size();
+            greed *= 1.01;
+            if (greed > 2) break;
+        }
+    }
+    return pixels;
+}
+
+// Add the points in <pixels> to <bands>, by which of 16 bands of brightness each one's pixel is in
+static void countBands(const std::vector<uint8_t>& image, const std::vector<int>& pixels, int targetCount, std::vector<double>& bands) {
+    for (int i = 0; i < targetCount && i * 2 + 1 < (int)pixels.size(); i++) {
+        bands[image[pixels[i * 2 + 1] * PIX_CT + pixels[i * 2]] / 16]++;
+    }
+}
+
+// The histogram sampler picks pixels of each brightness about as often as the rejection sampler it
+// replaced did, going by the share of the points in each of 16 bands of brightness over 10 seeds
+static bool testSamplerDistribution() {
+    // A radial gradient, with black bars top and bottom
+    std::vector<uint8_t> image(PIX_CT * PIX_CT, 0);
+    for (int y = 64; y < PIX_CT - 64; y++) {
+        for (int x = 0; x < PIX_CT; x++) {
+            double r = std::sqrt((x - 256.0) * (x - 256.0) + (y - 256.0) * (y - 256.0));
+            image[y * PIX_CT + x] = (uint8_t)std::clamp(255 - r, 0.0, 255.0);
+        }
+    }
+
+    const double tolerance = 0.01;
+    bool passed = true;
+    for (int targetCount : { 2000, 8000 }) {
+        std::vector<double> expected(16, 0), actual(16, 0);
+        for (int seed = 1; seed <= 10; seed++) {
+            std::mt19937 reference(seed);
+            countBands(image, rejectionSample(image, targetCount, 30, 230, 30, 1, reference), targetCount, expected);
+            Philox4x32 g(seed);
+            countBands(image, choosePixels(image, targetCount, 30, 230, 30, 1, 0, g), targetCount, actual);
+        }
+
+        double expectedTotal = std::accumulate(expected.begin(), expected.end(), 0.0);
+        double actualTotal = std::accumulate(actual.begin(), actual.end(), 0.0);
+        double worst = 0;
+        double distance = 0;
+        for (int b = 0; b < 16; b++) {
+            double difference = std::fabs(expected[b] / expectedTotal - actual[b] / actualTotal);
+            worst = std::max(worst, difference);
+            distance += difference / 2;
+        }
+        std::cout << "  " << targetCount << " points: largest band difference " << worst << ", total variation distance " << distance << std::endl;
+        if (worst > tolerance) passed = false;
+    }
+    return passed;
+}
+
+// Upsampling a whole clip's worth of points, long enough that output position times input rate is past
+// 2^31, gives outputRate / inputRate samples per point and goes exactly through every point on the way
+static bool testUpsampleLongClip() {
+    const int inputRate = 48000, outputRate = 192000;
+    const int inCount = 3 * (int)((1LL << 31) / outputRate);
+    std::vector<int16_t> samples(inCount * 2);
+    for (int i = 0; i < inCount; i++) {
+        samples[i * 2] = (int16_t)((i * 37) % 20000 - 10000);
+        samples[i * 2 + 1] = (int16_t)((i * 91) % 30000 - 15000);
+    }
+
+    bool passed = true;
+    for (int filter : { UPSAMPLE_LINEAR, UPSAMPLE_CUBIC, UPSAMPLE_SINC }) {
+        std::vector<int16_t> output = upsamplePath(samples, inputRate, outputRate, filter);
+        size_t expectedSize = (size_t)inCount * (outputRate / inputRate) * 2;
+        if (output.size() != expectedSize) {
+            std::cout << "  filter " << filter << ": " << output.size() << " samples, expected " << expectedSize << std::endl;
+            passed = false;
+            continue;
+        }
+        for (int i = 0; i < inCount; i++) {
+            size_t at = (size_t)i * (outputRate / inputRate) * 2;
+            if (output[at] != samples[i * 2] || output[at + 1] != samples[i * 2 + 1]) {
+                std::cout << "  filter " << filter << ": point " << i << " came out as " << output[at] << ", " << output[at + 1] <<
+                    " instead of " << samples[i * 2] << ", " << samples[i * 2 + 1] << std::endl;
+                passed = false;
+                break;
+            }
+        }
+    }
+    return passed;
+}
+
+// Every <n>th pixel lit, which gives a busy frame where nearly every point has an old one nearby whatever
+// came before it
+static std::vector<uint8_t> everyNth(int n) {
+    std::vector<uint8_t> image(PIX_CT * PIX_CT, 0);
+    for (int i = 0; i < PIX_CT * PIX_CT; i += n) image[i] = 255;
+    return image;
+}
+
+// How far the beam travels drawing <frames> one after another, with or without a warm start, in pixels.
+// The last frame's distance goes in <last> and its stroke count in <strokes>.
+static void warmTravel(const HilligossParams& params, const std::vector<std::vector<uint8_t>>& frames, bool warm, double& last, int& strokes) {
+    HilligossEngine<Philox4x32> engine(params);
+    PathHistory history;
+    for (int f = 0; f < (int)frames.size(); f++) {
+        std::vector<int16_t> path;
+        HilligossStats stats;
+        engine.process(frames[f], path, f, Philox4x32{ 1, (uint32_t)f }, warm ? &history : nullptr, &stats);
+        HilligossStats measured;
+        refinePath(path, params.targetCount, 0, &measured, params.width, params.height);
+        last = measured.jumpLengthBefore;
+        strokes = stats.strokes;
+    }
+}
+
+// A warm start never makes the route longer than routing the frame from scratch would, whether the frame
+// is unrelated to the one before it or the same image over and over, and it still breaks into strokes
+static bool testWarmStart() {
+    bool passed = true;
+    std::vector<uint8_t> ring = makeFrame(PIX_CT, PIX_CT, 10);
+    struct Sequence {
+        const char* name;
+        std::vector<std::vector<uint8_t>> frames;
+    };
+    const Sequence sequences[] = {
+        { "every 3rd pixel to every 5th", { everyNth(3), everyNth(5) } },
+        { "every 5th pixel to every 3rd", { everyNth(5), everyNth(3) } },
+        { "every 3rd pixel to a ring", { everyNth(3), ring } },
+        { "a ring to every 5th pixel", { ring, everyNth(5) } },
+        { "the same ring 5 times", { ring, ring, ring, ring, ring } },
+    };
+
+    for (int routing = 0; routing < 3; routing++) {
+        HilligossParams params;
+        params.routing = routing;
+        params.borderSamples = 0;
+        for (const Sequence& sequence : sequences) {
+            double warm, cold;
+            int warmStrokes, coldStrokes;
+            warmTravel(params, sequence.frames, true, warm, warmStrokes);
+            warmTravel(params, sequence.frames, false, cold, coldStrokes);
+            if (warm > cold || warmStrokes < 2) {
+                std::cout << "  routing " << routing << ", " << sequence.name << ": travelled " << (int)warm << " px in " << warmStrokes <<
+                    " strokes with a warm start, " << (int)cold << " px in " << coldStrokes << " without" << std::endl;
+                passed = false;
+            }
+        }
+    }
+    return passed;
+}
+
+// A draw with no prepare() before it, or after preparing some other image, comes out the same as
+// process() in every mode
+static bool testDrawWithoutPrepare() {
+    bool passed = true;
+    for (int mode = 0; mode <= 6; mode++) {
+        HilligossParams params;
+        params.width = 256;
+        params.height = 192;
+        params.targetCount = 1600;
+        params.mode = mode;
+        std::vector<uint8_t> image = makeFrame(params.width, params.height, 3);
+        std::vector<uint8_t> other = makeFrame(params.width, params.height, 20);
+
+        HilligossEngine<Philox4x32> processed(params), unprepared(params), otherPrepared(params);
+        int frameSamples = processed.pointsPerFrame() * 2;
+        std::vector<int16_t> expected(frameSamples), unpreparedOut(frameSamples), otherPreparedOut(frameSamples);
+        processed.process(image, params.width, expected, 3, Philox4x32{ 1, 3 });
+        unprepared.draw(image, params.width, unpreparedOut, 3, Philox4x32{ 1, 3 });
+        otherPrepared.prepare(other, params.width);
+        otherPrepared.draw(image, params.width, otherPreparedOut, 3, Philox4x32{ 1, 3 });
+
+        std::string what = "mode " + std::to_string(mode);
+        passed &= sameSamples(expected, unpreparedOut, what + ", no prepare()");
+        passed &= sameSamples(expected, otherPreparedOut, what + ", another image prepared");
+    }
+    return passed;
+}
+
+struct Test {
+    const char* name;
+    bool (*run)();
+};
+
+static const Test tests[] = {
+    { "determinism", testDeterminism },
+    { "sampler-distribution", testSamplerDistribution },
+    { "upsample-long-clip", testUpsampleLongClip },
+    { "warm-start", testWarmStart },
+    { "draw-without-prepare", testDrawWithoutPrepare },
+};
+
+int main(int argc, char** argv) {
+    std::string only = argc > 1 ? argv[1] : "";
+    int failures = 0;
+    int ran = 0;
+    for (const Test& test : tests) {
+        if (!only.empty() && only != test.name) continue;
+        ran++;
+        auto start = std::chrono::steady_clock::now();
+        bool passed = test.run();
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        std::cout << (passed ? "PASS " : "FAIL ") << test.name << " (" << (int)ms << " ms)" << std::endl;
+        if (!passed) failures++;
+    }
+    if (ran == 0) {
+        std::cout << "No test called " << only << std::endl;
+        return 1;
+    }
+    return failures > 0 ? 1 : 0;
+}